@@ -0,0 +1,155 @@
+#include "acpi.h"
+#include "lib/libp.h"
+#include "memory/mem.h"
+
+// The RSDP lives in identity mapped lower memory, either in the first KiB of
+// the EBDA or in the BIOS area between 0xE0000 and 0xFFFFF.
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_AREA_START  0xE0000
+#define BIOS_AREA_END    0x100000
+
+#define MADT_LAPIC         0
+#define MADT_LAPIC_ENABLED (1 << 0)
+
+typedef struct __attribute__((packed)) {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_paddr;
+} Rsdp;
+
+typedef struct __attribute__((packed)) {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} AcpiHeader;
+
+typedef struct __attribute__((packed)) {
+    AcpiHeader header;
+    u32 lapic_paddr;
+    u32 flags;
+} Madt;
+
+typedef struct __attribute__((packed)) {
+    u8 type;
+    u8 length;
+} MadtEntry;
+
+typedef struct __attribute__((packed)) {
+    MadtEntry entry;
+    u8 processor_id;
+    u8 apic_id;
+    u32 flags;
+} MadtLapic;
+
+static bool checksum_valid(const void *table, u32 size) {
+    const u8 *bytes = table;
+    u8 sum = 0;
+
+    for (u32 i = 0; i < size; ++i)
+        sum += bytes[i];
+
+    return sum == 0;
+}
+
+static Rsdp *scan_rsdp(u32 start, u32 end) {
+    for (u32 addr = start; addr + sizeof(Rsdp) <= end; addr += 16) {
+        Rsdp *rsdp = (Rsdp *) addr;
+        if (pmemeql(rsdp->signature, "RSD PTR ", 8) &&
+            checksum_valid(rsdp, sizeof(Rsdp)))
+            return rsdp;
+    }
+
+    return NULL;
+}
+
+static Rsdp *find_rsdp() {
+    u32 ebda = (u32) *(u16 *) EBDA_SEGMENT_PTR << 4;
+
+    if (ebda) {
+        Rsdp *rsdp = scan_rsdp(ebda, ebda + 1024);
+        if (rsdp)
+            return rsdp;
+    }
+
+    return scan_rsdp(BIOS_AREA_START, BIOS_AREA_END);
+}
+
+// Tables can be anywhere in physical memory so we map them in for as long as
+// we need them. We only know how big a table is after reading its header.
+static AcpiHeader *map_table(u32 paddr) {
+    AcpiHeader *header = map_physical(paddr, sizeof(AcpiHeader), 0);
+    u32 length = header->length;
+    unmap_physical(header, sizeof(AcpiHeader));
+
+    header = map_physical(paddr, length, 0);
+    if (!checksum_valid(header, length)) {
+        unmap_physical(header, length);
+        return NULL;
+    }
+
+    return header;
+}
+
+static void unmap_table(AcpiHeader *header) {
+    unmap_physical(header, header->length);
+}
+
+static u32 parse_madt(Madt *madt, u32 *apic_ids, u32 max, u32 *lapic_paddr) {
+    void *entry = (void *) (madt + 1);
+    void *end = (void *) madt + madt->header.length;
+    u32 count = 0;
+
+    *lapic_paddr = madt->lapic_paddr;
+
+    while (entry + sizeof(MadtEntry) <= end) {
+        MadtEntry *e = entry;
+        if (e->length < sizeof(MadtEntry))
+            break;
+
+        if (e->type == MADT_LAPIC && count < max) {
+            MadtLapic *lapic = entry;
+            if (lapic->flags & MADT_LAPIC_ENABLED)
+                apic_ids[count++] = lapic->apic_id;
+        }
+
+        entry += e->length;
+    }
+
+    return count;
+}
+
+u32 acpi_find_cpus(u32 *apic_ids, u32 max, u32 *lapic_paddr) {
+    Rsdp *rsdp = find_rsdp();
+    if (!rsdp)
+        return 0;
+
+    AcpiHeader *rsdt = map_table(rsdp->rsdt_paddr);
+    if (!rsdt)
+        return 0;
+
+    u32 *tables = (u32 *) (rsdt + 1);
+    u32 table_count = (rsdt->length - sizeof(AcpiHeader)) / sizeof(u32);
+    u32 count = 0;
+
+    for (u32 i = 0; i < table_count && !count; ++i) {
+        AcpiHeader *table = map_table(tables[i]);
+        if (!table)
+            continue;
+
+        if (pmemeql(table->signature, "APIC", 4))
+            count = parse_madt((Madt *) table, apic_ids, max, lapic_paddr);
+
+        unmap_table(table);
+    }
+
+    unmap_table(rsdt);
+    return count;
+}
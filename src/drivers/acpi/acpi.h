@@ -0,0 +1,12 @@
+#ifndef ACPI_H_
+#define ACPI_H_
+
+#include "lib/types.h"
+
+// Finds the processors listed in the ACPI MADT. Writes the local APIC id of up
+// to `max` enabled processors to `apic_ids` and the physical address of the
+// local APIC registers to `lapic_paddr`. Returns the number of processors
+// found, or zero if the firmware has no MADT.
+u32 acpi_find_cpus(u32 *apic_ids, u32 max, u32 *lapic_paddr);
+
+#endif // ACPI_H_
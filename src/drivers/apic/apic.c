@@ -0,0 +1,138 @@
+#include "apic.h"
+#include "drivers/timer/timer.h"
+#include "kernel/init.h"
+#include "lib/error.h"
+#include "lib/spinlock.h"
+#include "memory/mem.h"
+
+// Register offsets from the local APIC base
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+
+#define LVT_MASKED         (1 << 16)
+#define LVT_TIMER_PERIODIC (1 << 17)
+
+#define TIMER_DIVIDE_16 0x3
+
+#define ICR_INIT         (5 << 8)
+#define ICR_STARTUP      (6 << 8)
+#define ICR_SEND_PENDING (1 << 12)
+#define ICR_ASSERT       (1 << 14)
+#define ICR_LEVEL        (1 << 15)
+
+#define CALIBRATION_MS 10
+
+static volatile u32 *lapic_base = NULL;
+static u32 timer_ticks_per_ms;
+
+void *lapic_routines[LAPIC_VECTOR_END - LAPIC_VECTOR_BASE] = {0};
+
+static u32 lapic_read(u32 reg) {
+    return lapic_base[reg / sizeof(u32)];
+}
+
+static void lapic_write(u32 reg, u32 value) {
+    lapic_base[reg / sizeof(u32)] = value;
+}
+
+bool lapic_supported() {
+    CpuidRegs regs;
+    get_cpuid(CPUID_FEATURES, &regs);
+    return (regs.edx & CPUID_EDX_APIC) != 0;
+}
+
+static void lapic_enable() {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(
+        LAPIC_SVR,
+        lapic_read(LAPIC_SVR) | LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR
+    );
+}
+
+// Measures how fast the local timer counts against the PIT. The bus clock is
+// shared so the result holds for every cpu.
+static void lapic_timer_calibrate() {
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+    pit_wait_ms(CALIBRATION_MS);
+
+    u32 elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    timer_ticks_per_ms = elapsed / CALIBRATION_MS;
+}
+
+void lapic_init(u32 paddr) {
+    lapic_base =
+        map_physical(paddr, PAGE_SIZE, PAGE_WRITABLE | PAGE_CACHE_DISABLE);
+    lapic_enable();
+    lapic_timer_calibrate();
+}
+
+void lapic_init_ap() {
+    KERNEL_ASSERT(lapic_base);
+    lapic_enable();
+}
+
+u32 lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_timer_start(u32 freq) {
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INITIAL, timer_ticks_per_ms * 1000 / freq);
+}
+
+static void lapic_send_command(u32 apic_id, u32 command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_SEND_PENDING)
+        cpu_relax();
+}
+
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+    lapic_send_command(apic_id, ICR_ASSERT | vector);
+}
+
+void lapic_send_init(u32 apic_id) {
+    lapic_send_command(apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+    lapic_send_command(apic_id, ICR_INIT | ICR_LEVEL);
+}
+
+// Starts an application processor in real mode at `paddr`, which must be page
+// aligned and below 1 MiB.
+void lapic_send_startup(u32 apic_id, u32 paddr) {
+    lapic_send_command(apic_id, ICR_STARTUP | ICR_ASSERT | (paddr >> 12));
+}
+
+void lapic_install_handler(u8 vector, void (*handler)(InterruptRegisters *)) {
+    KERNEL_ASSERT(vector >= LAPIC_VECTOR_BASE && vector < LAPIC_VECTOR_END);
+    lapic_routines[vector - LAPIC_VECTOR_BASE] = handler;
+}
+
+void lapic_handler(InterruptRegisters *regs) {
+    void (*handler)(InterruptRegisters *);
+
+    handler = lapic_routines[regs->int_no - LAPIC_VECTOR_BASE];
+
+    if (handler)
+        handler(regs);
+    lapic_eoi();
+}
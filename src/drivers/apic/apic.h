@@ -0,0 +1,42 @@
+#ifndef APIC_H_
+#define APIC_H_
+
+#include "interrupts/interrupt.h"
+#include "lib/types.h"
+
+// Interrupt vectors raised by the local APIC. These sit right after the PIC
+// vectors. The spurious vector must have its low four bits set on older cpus.
+#define LAPIC_TIMER_VECTOR    48
+#define IPI_RESCHEDULE_VECTOR 49
+#define IPI_TLB_VECTOR        50
+#define LAPIC_SPURIOUS_VECTOR 63
+
+#define LAPIC_VECTOR_BASE 48
+#define LAPIC_VECTOR_END  64
+
+#define CPUID_EDX_APIC (1 << 9)
+
+bool lapic_supported();
+
+// Maps the local APIC registers at `paddr` and enables the local APIC of the
+// calling cpu. Must be called once on the bootstrap processor before any other
+// lapic function.
+void lapic_init(u32 paddr);
+
+// Enables the local APIC of an application processor.
+void lapic_init_ap();
+
+u32 lapic_id();
+void lapic_eoi();
+
+// Starts the local timer of the calling cpu firing every 1/`freq` seconds.
+void lapic_timer_start(u32 freq);
+
+void lapic_send_ipi(u32 apic_id, u8 vector);
+void lapic_send_init(u32 apic_id);
+void lapic_send_startup(u32 apic_id, u32 paddr);
+
+void lapic_install_handler(u8 vector, void (*handler)(InterruptRegisters *));
+void lapic_handler(InterruptRegisters *regs);
+
+#endif // APIC_H_
@@ -0,0 +1,115 @@
+#include "clock.h"
+#include "drivers/timer/timer.h"
+#include "kernel/init.h"
+#include "lib/error.h"
+#include "lib/libp.h"
+#include "lib/logging.h"
+#include "lib/types.h"
+#include "memory/mem.h"
+#include "syscall/syscall.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+#define CALIBRATION_MS 50
+
+static ClockPage *clock_page = NULL;
+static u64 tsc_hz = 0;
+static u64 boot_tsc = 0;
+
+static bool tsc_supported() {
+    CpuidRegs regs;
+    get_cpuid(CPUID_FEATURES, &regs);
+    return (regs.edx & CPUID_EDX_TSC) != 0;
+}
+
+// Counts TSC cycles over a fixed PIT interval.
+static u64 calibrate_tsc() {
+    u64 start = read_tsc();
+    pit_wait_ms(CALIBRATION_MS);
+    u64 end = read_tsc();
+
+    return (end - start) * (1000 / CALIBRATION_MS);
+}
+
+// Converts TSC cycles to nanoseconds. The low and high halves are scaled
+// separately since the full product doesn't fit in 64 bits. The result is
+// exactly the rounded down value, so it agrees with the user side calculation.
+static u64 scale_tsc(u64 cycles) {
+    u64 lo = (u32) cycles;
+    u64 hi = cycles >> 32;
+
+    return ((lo * clock_page->tsc_mult) >> clock_page->tsc_shift) +
+           ((hi * clock_page->tsc_mult) << (32 - clock_page->tsc_shift));
+}
+
+void clock_tick(u64 ticks) {
+    u64 tsc = tsc_hz ? read_tsc() : 0;
+
+    clock_page->seq += 1;
+    __sync_synchronize();
+
+    clock_page->ticks = ticks;
+    if (tsc_hz) {
+        clock_page->tsc_base = tsc;
+        clock_page->ns_base = scale_tsc(tsc - boot_tsc);
+    }
+    else {
+        clock_page->ns_base = ticks * (NS_PER_SEC / clock_page->tick_hz);
+    }
+
+    __sync_synchronize();
+    clock_page->seq += 1;
+}
+
+u64 clock_ns() {
+    u32 seq;
+    u64 tsc_base, ns;
+
+    do {
+        seq = clock_page->seq;
+        __sync_synchronize();
+        tsc_base = clock_page->tsc_base;
+        ns = clock_page->ns_base;
+        __sync_synchronize();
+    } while ((seq & 1) || seq != clock_page->seq);
+
+    if (tsc_hz)
+        ns += scale_tsc(read_tsc() - tsc_base);
+
+    return ns;
+}
+
+// Returns the address of the clock page, see ClockPage.
+SyscallResult syscall_get_clock_page() {
+    SYSCALL_RETURN((u32) clock_page, 0);
+}
+
+void clock_init(u32 tick_hz) {
+    clock_page = mem_alloc(&user_ro_heap, 1, PAGE_USER_MODE);
+    pmemset(clock_page, 0, PAGE_SIZE);
+    clock_page->tick_hz = tick_hz;
+
+    if (tsc_supported())
+        tsc_hz = calibrate_tsc();
+
+    if (tsc_hz) {
+        // Use the most precise scale whose multiplier fits in 32 bits
+        u32 shift = 32;
+        while (shift && (NS_PER_SEC << shift) / tsc_hz > 0xFFFFFFFF)
+            shift -= 1;
+
+        clock_page->tsc_mult = (NS_PER_SEC << shift) / tsc_hz;
+        clock_page->tsc_shift = shift;
+        clock_page->tsc_khz = tsc_hz / 1000;
+        boot_tsc = read_tsc();
+
+        printk(DEBUG, "TSC runs at %u kHz\n", clock_page->tsc_khz);
+    }
+    else {
+        printk(DEBUG, "No TSC, the clock has tick resolution\n");
+    }
+
+    clock_tick(0);
+
+    register_syscall(22, syscall_get_clock_page);
+}
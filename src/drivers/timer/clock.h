@@ -0,0 +1,47 @@
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include "lib/types.h"
+
+// The monotonic clock counts nanoseconds since boot. It is driven by the time
+// stamp counter, calibrated against the PIT at boot, and falls back to timer
+// ticks on cpus without one.
+//
+// The clock state is published in a page every process can read, so user
+// programs can tell the time without a syscall:
+//
+//     do {
+//         seq = page->seq;
+//         snapshot = *page;
+//     } while (seq & 1 || seq != page->seq);
+//
+//     ns = snapshot.ns_base;
+//     if (snapshot.tsc_khz)
+//         ns += (rdtsc() - snapshot.tsc_base) * snapshot.tsc_mult >>
+//               snapshot.tsc_shift;
+//
+// The kernel updates the snapshot on every tick, so the TSC delta stays well
+// within 32 bits and the multiplication fits in 64.
+typedef struct {
+    volatile u32 seq; // Odd while the kernel is updating the page
+    u32 tsc_khz;      // Zero if time only advances with ticks
+    u32 tsc_mult;
+    u32 tsc_shift;
+    u32 tick_hz;
+    u32 reserved;
+    u64 ticks;    // Timer ticks at the time of the snapshot
+    u64 tsc_base; // TSC value at the time of the snapshot
+    u64 ns_base;  // Nanoseconds since boot at the time of the snapshot
+} ClockPage;
+
+// Calibrates the TSC and sets up the clock page. Must be called after the
+// memory and the PIT have been initialized, with interrupts disabled.
+void clock_init(u32 tick_hz);
+
+// Takes a new snapshot. Called by the cpu that keeps time on every tick.
+void clock_tick(u64 ticks);
+
+// Nanoseconds since boot.
+u64 clock_ns();
+
+#endif // CLOCK_H_
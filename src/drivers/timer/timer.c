@@ -1,16 +1,24 @@
 #include "timer.h"
+#include "drivers/apic/apic.h"
+#include "drivers/timer/clock.h"
+#include "drivers/timer/wheel.h"
 #include "interrupts/interrupt.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
+#include "lib/spinlock.h"
 #include "lib/types.h"
 #include "lib/util.h"
+#include "memory/mem.h"
+#include "process/processes.h"
 #include "syscall/syscall.h"
 #include "terminal/terminal.h"
 
 #define DEFAULT_SCHED_TICKS 10
 
+#define PIT_FREQ 1193182
+
 static u64 system_ticks; // Total number of system ticks
 static u32 sched_ticks;  // Ticks between scheduler function call
-static u32 sched_tick_cur;
 
 void (*sched_callback)(InterruptRegisters *regs) = NULL;
 const u32 freq = 1000;
@@ -19,13 +27,95 @@ void timer_no_op() {
     return;
 }
 
-void timer_handler(InterruptRegisters *regs) {
-    if (sched_tick_cur == 0) {
-        sched_tick_cur = sched_ticks;
-        sched_callback(regs);
+// Every cpu counts down to its own preemption. The boot cpu is driven by the
+// PIT and the others by their local APIC timer, both at `freq`.
+static void sched_tick(InterruptRegisters *regs) {
+    Cpu *cpu = this_cpu();
+
+    rt_tick();
+
+    if (cpu->sched_ticks_left > 1) {
+        --cpu->sched_ticks_left;
+        return;
     }
+
+    cpu->sched_ticks_left = sched_ticks;
+    sched_callback(regs);
+}
+
+// Only the boot cpu keeps time, so kernel timers all run there.
+void timer_handler(InterruptRegisters *regs) {
     ++system_ticks;
-    --sched_tick_cur;
+    clock_tick(system_ticks);
+    timer_wheel_advance(system_ticks);
+    sched_tick(regs);
+}
+
+void local_timer_handler(InterruptRegisters *regs) {
+    sched_tick(regs);
+}
+
+// Busy waits for `ms` milliseconds on PIT channel 2, which doesn't need
+// interrupts. `ms` must be at most 54.
+void pit_wait_ms(u32 ms) {
+    u32 count = PIT_FREQ * ms / 1000;
+    KERNEL_ASSERT(count <= 0xFFFF);
+
+    // Gate channel 2 on but keep the speaker disconnected
+    u8 control = (inb(0x61) & ~0x02) | 0x01;
+    outb(0x61, control);
+
+    // Channel 2, lobyte/hibyte, interrupt on terminal count : 1011 0000
+    outb(0x43, 0xB0);
+    outb(0x42, (u8) (count & 0xFF));
+    outb(0x42, (u8) ((count >> 8) & 0xFF));
+
+    // Restart the count by toggling the gate
+    outb(0x61, control & ~0x01);
+    outb(0x61, control);
+
+    while (!(inb(0x61) & 0x20))
+        cpu_relax();
+}
+
+u64 timer_ticks() {
+    return system_ticks;
+}
+
+u64 timer_deadline_ms(u32 ms) {
+    return system_ticks + ((u64) ms * freq + 999) / 1000;
+}
+
+#define GET_TICKS_INVALID_PTR 1
+
+// Writes the number of timer ticks since boot to the u64 at `ticks_ptr`.
+// Returns the tick frequency in Hz.
+SyscallResult syscall_get_ticks(u32 ticks_ptr) {
+    u64 *ticks = validate_user_writable_range(ticks_ptr, sizeof(u64));
+    if (!ticks)
+        SYSCALL_RETURN(0, GET_TICKS_INVALID_PTR);
+
+    *ticks = system_ticks;
+    SYSCALL_RETURN(freq, 0);
+}
+
+// Blocks the calling thread until the tick count given by `ticks_lo` and
+// `ticks_hi` has been reached.
+SyscallResult syscall_sleep_until(u32 ticks_lo, u32 ticks_hi) {
+    u64 deadline = (u64) ticks_hi << 32 | ticks_lo;
+
+    if (deadline > system_ticks)
+        thread_wait(NULL, deadline);
+
+    SYSCALL_RETURN(0, 0);
+}
+
+// Blocks the calling thread for at least `ms` milliseconds.
+SyscallResult syscall_sleep_for(u32 ms) {
+    if (ms)
+        thread_wait(NULL, timer_deadline_ms(ms));
+
+    SYSCALL_RETURN(0, 0);
 }
 
 SyscallResult
@@ -42,16 +132,30 @@ void init_timer() {
 
     system_ticks = 0;
     sched_ticks = DEFAULT_SCHED_TICKS; // Until user override w/ syscall
-    sched_tick_cur = DEFAULT_SCHED_TICKS;
     sched_callback = timer_no_op;
 
+    lapic_install_handler(LAPIC_TIMER_VECTOR, local_timer_handler);
+
     register_syscall(5, syscall_reg_tmr_cb);
+    register_syscall(19, syscall_get_ticks);
+    register_syscall(20, syscall_sleep_until);
+    register_syscall(21, syscall_sleep_for);
+
+    set_syscall_flags(20, SYSCALL_NO_BATCH);
+    set_syscall_flags(21, SYSCALL_NO_BATCH);
 
     // PIT oscillates 1.1931816666 Mhz
-    u32 divisor = 1193180 / freq;
+    u32 divisor = PIT_FREQ / freq;
 
     // Use Square Wave Generator Mode : 0011 0110
     outb(0x43, 0x36);
     outb(0x40, (u8) (divisor & 0xFF));
     outb(0x40, (u8) ((divisor >> 8) & 0xFF));
+
+    clock_init(freq);
+}
+
+// Starts the local timer of an application processor.
+void init_timer_ap() {
+    lapic_timer_start(freq);
 }
@@ -13,5 +13,14 @@ SyscallResult
 syscall_reg_tmr_cb(void(callback)(InterruptRegisters *regs), u32 ticks);
 
 void init_timer();
+void init_timer_ap();
+
+// Number of timer ticks since boot. Kernel timers expire in ticks.
+u64 timer_ticks();
+
+// Returns the tick `ms` milliseconds from now, rounded up to whole ticks.
+u64 timer_deadline_ms(u32 ms);
+
+void pit_wait_ms(u32 ms);
 
 #endif // TIMER_H_
@@ -0,0 +1,105 @@
+#include "wheel.h"
+#include "lib/error.h"
+#include "lib/types.h"
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+
+// Number of ticks ahead the wheel can hold. Timers further out are parked in
+// the last slot that far ahead and moved again when it cascades.
+#define WHEEL_RANGE ((u64) 1 << (WHEEL_LEVELS * WHEEL_BITS))
+
+static KernelTimer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static u64 wheel_next = 0; // Next tick to process
+
+static void slot_insert(KernelTimer **slot, KernelTimer *timer) {
+    timer->next = *slot;
+    timer->pprev = slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    *slot = timer;
+}
+
+static void slot_remove(KernelTimer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Puts a timer in the slot covering its expiry relative to the next tick.
+static void wheel_insert(KernelTimer *timer) {
+    u64 expires = timer->expires;
+    if (expires < wheel_next)
+        expires = wheel_next;
+    if (expires - wheel_next >= WHEEL_RANGE)
+        expires = wheel_next + WHEEL_RANGE - 1;
+
+    u64 delta = expires - wheel_next;
+    u32 level = 0;
+    while (delta >= (u64) WHEEL_SLOTS << (level * WHEEL_BITS))
+        level += 1;
+
+    u32 index = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    slot_insert(&wheel[level][index], timer);
+}
+
+// Moves the timers of the current slot of each upper level one level down. A
+// level only moves on once the level below it has wrapped around.
+static void wheel_cascade() {
+    for (u32 level = 1; level < WHEEL_LEVELS; ++level) {
+        u32 index = (wheel_next >> (level * WHEEL_BITS)) & WHEEL_MASK;
+        KernelTimer *timer = wheel[level][index];
+        wheel[level][index] = NULL;
+
+        while (timer) {
+            KernelTimer *next = timer->next;
+            wheel_insert(timer);
+            timer = next;
+        }
+
+        if (index)
+            break;
+    }
+}
+
+void timer_add(KernelTimer *timer, u64 expires, TimerCallback callback) {
+    KERNEL_ASSERT(!timer_pending(timer));
+    timer->expires = expires;
+    timer->callback = callback;
+    wheel_insert(timer);
+}
+
+bool timer_cancel(KernelTimer *timer) {
+    if (!timer_pending(timer))
+        return false;
+
+    slot_remove(timer);
+    return true;
+}
+
+bool timer_pending(KernelTimer *timer) {
+    return timer->pprev != NULL;
+}
+
+void timer_wheel_advance(u64 now) {
+    while (wheel_next <= now) {
+        u32 index = wheel_next & WHEEL_MASK;
+        if (!index)
+            wheel_cascade();
+
+        // Timers added by a callback for this tick or earlier land in this
+        // same slot and still run in this pass.
+        KernelTimer *timer;
+        while ((timer = wheel[0][index])) {
+            slot_remove(timer);
+            timer->callback(timer);
+        }
+
+        wheel_next += 1;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#include "lib/types.h"
+
+// Kernel timers are kept in a hierarchical timing wheel. Each level has 64
+// slots and every slot of a level spans 64 times the ticks of a slot in the
+// level below. Timers go straight into the slot of the level that covers their
+// expiry, so adding and cancelling a timer takes constant time. When the lowest
+// level wraps around, the next slot of the level above is cascaded down. Only
+// timers that are about to expire are ever looked at.
+//
+// Everything here must be done with the kernel lock held.
+
+typedef struct KernelTimer_ KernelTimer;
+typedef void (*TimerCallback)(KernelTimer *timer);
+
+// Usually embedded in the structure the timer is for. A zeroed timer is valid
+// and not pending.
+struct KernelTimer_ {
+    KernelTimer *next;
+    KernelTimer **pprev; // NULL while the timer isn't pending
+    u64 expires;         // Tick at which the callback runs
+    TimerCallback callback;
+};
+
+// Arms `timer` to call `callback` once the tick count reaches `expires`.
+// Expiry times that already passed fire on the next tick. The timer must not be
+// pending.
+void timer_add(KernelTimer *timer, u64 expires, TimerCallback callback);
+
+// Disarms `timer`. Returns false if it wasn't pending.
+bool timer_cancel(KernelTimer *timer);
+
+bool timer_pending(KernelTimer *timer);
+
+// Runs the callbacks of every timer expiring up to and including tick `now`.
+// Callbacks may add and cancel timers.
+void timer_wheel_advance(u64 now);
+
+#endif // WHEEL_H_
@@ -1,7 +1,9 @@
 #include "interrupt.h"
+#include "drivers/apic/apic.h"
 #include "drivers/keyboard/keyboard.h"
 #include "kernel/init.h"
 #include "kernel/kernel.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
 #include "lib/logging.h"
 #include "lib/util.h"
@@ -116,7 +118,7 @@ void init_idt() {
         );
     }
 
-    for (u32 i = 32; i < 48; i++) {
+    for (u32 i = 32; i < LAPIC_VECTOR_END; i++) {
         idt[i] = make_gate_descriptor(
             (u32) cpu_interrupt_table[i], idtgt_Int, dpl_Kernel
         );
@@ -127,6 +129,13 @@ void init_idt() {
     load_idt(&idt_ptr);
 }
 
+/**
+ * @brief Loads the shared IDT on an application processor
+ */
+void reload_idt() {
+    load_idt(&idt_ptr);
+}
+
 #define INT_PAGE_FAULT 14
 
 const char *INTERRUPT_NAMES[32] = {
@@ -217,15 +226,61 @@ static void report_page_fault(InterruptRegisters *regs) {
     );
 }
 
+/**
+ * @brief Handles page faults that are part of normal operation. Writes to
+ * copy-on-write pages fault until the page has been copied.
+ * @param regs Interrupt registers
+ * @return true if the faulting instruction can be retried
+ */
+static bool page_fault_resolved(InterruptRegisters *regs) {
+    u32 write_protected = PF_EC_PRESENT | PF_EC_WRITE;
+    if ((regs->err_code & write_protected) != write_protected)
+        return false;
+    return resolve_cow((void *) regs->cr2);
+}
+
+/**
+ * @brief Signals the end of an external interrupt to whichever controller
+ * raised it. Only needed by handlers that never return.
+ * @param regs Interrupt registers
+ */
+void interrupt_eoi(InterruptRegisters *regs) {
+    if (regs->int_no >= LAPIC_VECTOR_BASE)
+        lapic_eoi();
+    else
+        pic_eoi(regs->int_no - 32);
+}
+
 /**
  * @brief Handles software interrupts. Routes to irq if external.
  * @param regs Interrupt registers
  */
 void isr_handler(InterruptRegisters *regs) {
     u32 interrupt = regs->int_no;
-    KERNEL_ASSERT(interrupt < 48);
-    if (interrupt >= 32)
+    KERNEL_ASSERT(interrupt < LAPIC_VECTOR_END);
+
+    if (interrupt == LAPIC_SPURIOUS_VECTOR)
+        return;
+
+    // TLB shootdowns come from a cpu holding the kernel lock and waiting on us.
+    if (interrupt == IPI_TLB_VECTOR) {
+        lapic_handler(regs);
+        return;
+    }
+
+    // Interrupts taken while we already hold the lock, like faults in the
+    // kernel or irqs before the boot cpu first schedules, just keep it.
+    bool nested = kernel_lock_held();
+    if (!nested)
+        kernel_lock();
+
+    if (interrupt >= LAPIC_VECTOR_BASE)
+        lapic_handler(regs);
+    else if (interrupt >= 32)
         irq_handler(regs);
+    else if (interrupt == INT_PAGE_FAULT && page_fault_resolved(regs)) {
+        // The faulting instruction runs again
+    }
     else {
         printk(DEBUG, "[INT] %s\n", INTERRUPT_NAMES[interrupt]);
         switch (interrupt) {
@@ -235,4 +290,10 @@ void isr_handler(InterruptRegisters *regs) {
         }
         kernel_panic();
     }
+
+    if (!nested) {
+        if (is_user_mode(regs->cs))
+            return_to_user();
+        kernel_unlock();
+    }
 }
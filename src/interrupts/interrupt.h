@@ -34,8 +34,10 @@ typedef struct {
 } InterruptRegisters;
 
 void init_idt();
+void reload_idt();
 void irq_install_handler(u32 irq, void (*handler)(InterruptRegisters *reg));
 
 void pic_eoi(u8 irq);
+void interrupt_eoi(InterruptRegisters *regs);
 
 #endif // INTERRUPT_H_
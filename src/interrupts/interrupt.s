@@ -4,7 +4,7 @@ section ".data" align 32
 
 public cpu_interrupts
 cpu_interrupts:
-rept 48 int_no:0 {
+rept 64 int_no:0 {
     dd interrupt_wrapper_#int_no
 }
 
@@ -12,7 +12,7 @@ section ".text" executable
 
 extrn isr_handler
 
-rept 48 int_no:0 {
+rept 64 int_no:0 {
     if int_no = 8 | (10 <= int_no & int_no <= 14)
         ;; interrupts with error codes (8, 10, 11, 12, 13, 14)
         interrupt_wrapper_#int_no:
@@ -0,0 +1,39 @@
+#include "channel.h"
+#include "lib/libp.h"
+#include "memory/heap.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "syscall/syscall.h"
+
+_Static_assert(sizeof(ChannelHeader) <= PAGE_SIZE, "Channel header size");
+
+#define CHANNEL_CREATE_INVALID_SIZE 1
+#define CHANNEL_CREATE_NO_SPACE     2
+
+// Creates a channel with `data_pages` pages of data on the heap of the current
+// process and returns the address of its header. `data_pages` must be a power
+// of two.
+SyscallResult syscall_channel_create(u32 data_pages) {
+    if (!data_pages || data_pages > CHANNEL_MAX_PAGES ||
+        (data_pages & (data_pages - 1)))
+        SYSCALL_RETURN(0, CHANNEL_CREATE_INVALID_SIZE);
+
+    Process *proc = current->process;
+    u32 pages = data_pages + 1;
+
+    ChannelHeader *header = heap_try_alloc(&proc->heap, pages);
+    if (!header)
+        SYSCALL_RETURN(0, CHANNEL_CREATE_NO_SPACE);
+
+    alloc_pages(header, PAGE_WRITABLE | PAGE_USER_MODE, pages);
+    pmemset(header, 0, pages * PAGE_SIZE);
+
+    header->size = data_pages * PAGE_SIZE;
+    header->data_offset = PAGE_SIZE;
+
+    SYSCALL_RETURN((u32) header, 0);
+}
+
+void channels_init() {
+    register_syscall(26, syscall_channel_create);
+}
@@ -0,0 +1,47 @@
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include "lib/types.h"
+
+// A channel streams bytes from producers in one process to a consumer in
+// another through shared memory, without a syscall per message. The kernel
+// only creates the channel. channel_create lays out the pages on the caller's
+// heap, and the caller hands them to its peer by sending a PageGrant with
+// GRANT_SHARE_MEMORY. After that the kernel is only involved when one side has
+// to sleep.
+//
+// The memory starts with a ChannelHeader page, followed by `size` bytes of
+// data. `head` and `tail` count bytes and only ever increase. Offsets into the
+// data are masked with `size - 1`. Each index has its own cache line, so the
+// producer and the consumer don't fight over one.
+//
+// A single producer writes its data at `tail`, then advances `tail`. Several
+// producers first claim space by atomically adding to `reserve`, write their
+// data, wait for `tail` to reach the start of their space and then advance
+// it. The consumer reads from `head` up to `tail`, then advances `head`.
+//
+// A consumer that finds the channel empty sets `consumer_waiting`, checks
+// `tail` once more and calls futex_wait on `tail`. A producer that advances
+// `tail` while `consumer_waiting` is set clears it and calls futex_wake on
+// `tail`. Producers waiting for space do the same with `producer_waiting` and
+// `head`. Futexes are keyed by physical address, so both sides wait on the
+// same word even though it's mapped at different addresses.
+
+#define CHANNEL_CACHE_LINE 64
+#define CHANNEL_MAX_PAGES  256 // Data pages
+
+typedef struct {
+    volatile u32 head; // Written by the consumer
+    u8 head_pad[CHANNEL_CACHE_LINE - sizeof(u32)];
+    volatile u32 tail; // Written by the producers
+    volatile u32 reserve;
+    u8 tail_pad[CHANNEL_CACHE_LINE - 2 * sizeof(u32)];
+    volatile u32 consumer_waiting;
+    volatile u32 producer_waiting;
+    u32 size;        // Bytes of data, a power of two
+    u32 data_offset; // Byte offset of the data from the header
+} ChannelHeader;
+
+void channels_init();
+
+#endif // CHANNEL_H_
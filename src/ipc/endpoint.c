@@ -0,0 +1,134 @@
+#include "endpoint.h"
+#include "ipc/topic.h"
+#include "memory/heap.h"
+#include "memory/mem.h"
+#include "process/pool.h"
+#include "syscall/syscall.h"
+
+static Pool endpoint_pool;
+
+// The region the mailbox of an endpoint was set up in, status page first
+static void *endpoint_region(MailboxHeader *mailbox) {
+    return mailbox->first_page - PAGE_SIZE;
+}
+
+MailboxHeader *endpoint_mailbox(Process *proc, u32 id) {
+    if (!id)
+        return &proc->mailbox;
+    if (id >= PROCESS_ENDPOINTS)
+        return NULL;
+    return proc->endpoints[id - 1];
+}
+
+void endpoints_free(Process *proc) {
+    for (u32 i = 0; i < PROCESS_ENDPOINTS - 1; ++i) {
+        MailboxHeader *mailbox = proc->endpoints[i];
+        if (!mailbox)
+            continue;
+
+        mailbox_del(mailbox);
+        pool_destroy(&endpoint_pool, mailbox);
+        proc->endpoints[i] = NULL;
+    }
+}
+
+void endpoints_drop_inherited(Process *parent, Heap *heap) {
+    for (u32 i = 0; i < PROCESS_ENDPOINTS - 1; ++i) {
+        MailboxHeader *mailbox = parent->endpoints[i];
+        if (!mailbox)
+            continue;
+
+        mailbox_unmap_inherited(mailbox);
+        heap_free(heap, endpoint_region(mailbox));
+    }
+}
+
+#define ENDPOINT_CREATE_FULL     1
+#define ENDPOINT_CREATE_NO_SPACE 2
+
+// Creates an endpoint for the calling process and returns its id.
+SyscallResult syscall_endpoint_create() {
+    Process *proc = current->process;
+
+    u32 index = 0;
+    while (index < PROCESS_ENDPOINTS - 1 && proc->endpoints[index])
+        index += 1;
+    if (index == PROCESS_ENDPOINTS - 1)
+        SYSCALL_RETURN(0, ENDPOINT_CREATE_FULL);
+
+    void *region = heap_try_alloc(&proc->heap, MAILBOX_REGION_PAGES);
+    if (!region)
+        SYSCALL_RETURN(0, ENDPOINT_CREATE_NO_SPACE);
+
+    MailboxHeader *mailbox = pool_create(&endpoint_pool);
+    mailbox_init(mailbox, region + PAGE_SIZE, PAGE_WRITABLE);
+    proc->endpoints[index] = mailbox;
+
+    SYSCALL_RETURN(index + 1, 0);
+}
+
+// Unmaps and frees a region a message put on `heap`, as far as it is still
+// there.
+static void region_release(Heap *heap, void *addr) {
+    u32 pages = heap_allocation_pages(heap, addr);
+    if (!pages)
+        return;
+
+    heap_free(heap, addr);
+    for (u32 i = 0; i < pages; ++i) {
+        void *page = addr + i * PAGE_SIZE;
+        if (entry_present(get_entry(page)))
+            free_page(page);
+    }
+}
+
+// Reads every unread message of an endpoint of the current process and frees
+// the pages granted or published to it, which nobody could release anymore.
+static void endpoint_drain(Heap *heap, MailboxHeader *mailbox) {
+    MailboxMessage message;
+
+    while (mailbox_read_message(mailbox, 0, 0, &message)) {
+        if (message.header.flags & MESSAGE_GRANT) {
+            PageGrant *grant = (PageGrant *) message.data;
+            region_release(heap, grant->addr);
+        }
+        else if (message.header.flags & MESSAGE_TOPIC) {
+            TopicMessage *topic = (TopicMessage *) message.data;
+            region_release(heap, topic->addr);
+        }
+    }
+}
+
+#define ENDPOINT_NOT_FOUND 1
+
+// Destroys an endpoint of the calling process along with its unread messages
+// and the pages granted with them.
+// Threads blocked reading from it or sending to it fail like they would for a
+// missing endpoint.
+SyscallResult syscall_endpoint_destroy(u32 id) {
+    Process *proc = current->process;
+    MailboxHeader *mailbox = id ? endpoint_mailbox(proc, id) : NULL;
+    if (!mailbox)
+        SYSCALL_RETURN(false, ENDPOINT_NOT_FOUND);
+
+    void *region = endpoint_region(mailbox);
+    proc->endpoints[id - 1] = NULL;
+    endpoint_drain(&proc->heap, mailbox);
+    mailbox_del(mailbox);
+    heap_free(&proc->heap, region);
+    pool_destroy(&endpoint_pool, mailbox);
+
+    // Everyone blocked on the process looks their endpoint up again
+    wake_all(&proc->mailbox_waiters);
+    wake_all(&proc->sender_waiters);
+    wake_all(&proc->event_waiters);
+
+    SYSCALL_RETURN(true, 0);
+}
+
+void endpoints_init() {
+    pool_init(&endpoint_pool, sizeof(MailboxHeader));
+
+    register_syscall(39, syscall_endpoint_create);
+    register_syscall(40, syscall_endpoint_destroy);
+}
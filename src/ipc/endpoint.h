@@ -0,0 +1,34 @@
+#ifndef ENDPOINT_H_
+#define ENDPOINT_H_
+
+#include "ipc/mailbox.h"
+#include "lib/types.h"
+#include "process/processes.h"
+
+// Endpoints are extra mailboxes a process can create, each with its own ring,
+// capacity, lanes and sender chains. Busy servers can shard their traffic over
+// them, so a reader of one endpoint never scans the messages of another.
+//
+// An endpoint is addressed by the pid of its process and its id, which goes in
+// the upper byte of the send_message, read_message and WaitCondition flags
+// with IPC_ENDPOINT. Endpoint zero is the mailbox every process starts with.
+// Send credits only apply to endpoint zero.
+//
+// The ring of an endpoint lives in its own region of MAILBOX_REGION_PAGES on
+// the process heap, laid out like the process mailbox.
+
+// The mailbox of endpoint `id` of `proc`, or NULL if there is no such
+// endpoint.
+MailboxHeader *endpoint_mailbox(Process *proc, u32 id);
+
+// Frees every endpoint of a process. Must be called from within its address
+// space.
+void endpoints_free(Process *proc);
+
+// Releases the endpoint regions a forked process inherited from `parent` on
+// its heap. Must be called from within the forked address space.
+void endpoints_drop_inherited(Process *parent, Heap *heap);
+
+void endpoints_init();
+
+#endif // ENDPOINT_H_
@@ -0,0 +1,85 @@
+#include "futex.h"
+#include "drivers/timer/timer.h"
+#include "lib/types.h"
+#include "lib/util.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "process/queue.h"
+#include "syscall/syscall.h"
+
+#define FUTEX_BUCKETS 64
+
+// Waiters are spread over buckets by key. Threads waiting on different words
+// can share a bucket, so wakers check the key of each thread.
+static Queue futex_buckets[FUTEX_BUCKETS];
+
+static Queue *futex_bucket(u32 key) {
+    return &futex_buckets[(key >> 2) % FUTEX_BUCKETS];
+}
+
+// Finds the physical address of the word at `addr`, or 0 if it isn't a valid
+// user word. Copy-on-write pages are copied first, so the word is at the
+// address the process will write to.
+static u32 futex_key(u32 addr) {
+    if (addr & 3 || !validate_user_writable(addr))
+        return 0;
+    return get_paddr(get_entry((void *) addr)) | (addr & 0xFFF);
+}
+
+#define FUTEX_INVALID_ADDR 1
+#define FUTEX_WOULD_BLOCK  2
+#define FUTEX_TIMED_OUT    3
+
+// Sleeps until futex_wake is called on the word at `addr` if it still holds
+// `expected`. Checking the word and going to sleep happen under the kernel
+// lock, so a wake after the user changed the word can't be missed. Gives up
+// after `timeout` milliseconds unless it is zero.
+SyscallResult syscall_futex_wait(u32 addr, u32 expected, u32 timeout) {
+    u32 key = futex_key(addr);
+    if (!key)
+        SYSCALL_RETURN(false, FUTEX_INVALID_ADDR);
+
+    if (*(volatile u32 *) addr != expected)
+        SYSCALL_RETURN(false, FUTEX_WOULD_BLOCK);
+
+    u64 deadline = timeout ? timer_deadline_ms(timeout) : 0;
+    current->futex_key = key;
+
+    if (!thread_wait(futex_bucket(key), deadline))
+        SYSCALL_RETURN(false, FUTEX_TIMED_OUT);
+
+    SYSCALL_RETURN(true, 0);
+}
+
+// Wakes up to `n` threads waiting on the word at `addr`, oldest first. Returns
+// the number of threads woken.
+SyscallResult syscall_futex_wake(u32 addr, u32 n) {
+    u32 key = futex_key(addr);
+    if (!key)
+        SYSCALL_RETURN(0, FUTEX_INVALID_ADDR);
+
+    QueueNode *node = futex_bucket(key)->head;
+    u32 woken = 0;
+
+    while (node && woken < n) {
+        Thread *thread = FIELD_PARENT_PTR(Thread, queue_node, node);
+        node = node->next;
+
+        if (thread->futex_key == key) {
+            thread_wake(thread);
+            woken += 1;
+        }
+    }
+
+    SYSCALL_RETURN(woken, 0);
+}
+
+void futex_init() {
+    for (u32 i = 0; i < FUTEX_BUCKETS; ++i)
+        queue_init(&futex_buckets[i]);
+
+    register_syscall(24, syscall_futex_wait);
+    register_syscall(25, syscall_futex_wake);
+
+    set_syscall_flags(24, SYSCALL_NO_BATCH);
+}
@@ -0,0 +1,13 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+// Futexes let user programs build locks and condition variables on plain words
+// of memory. The uncontended paths stay in user space, only threads that have
+// to wait enter the kernel to sleep on a word until another thread wakes them.
+//
+// Words are identified by their physical address, so processes sharing memory
+// can wait on the same word from different virtual addresses.
+
+void futex_init();
+
+#endif // FUTEX_H_
@@ -1,15 +1,10 @@
 #include "ipc/mailbox.h"
 #include "lib/error.h"
 #include "lib/libp.h"
-#include "lib/logging.h"
 #include "lib/util.h"
 #include "mailbox.h"
 #include "memory/mem.h"
 
-void *page_ptr(void *addr) {
-    return (void *) (((u32) addr >> 12) << 12 /* Page Size Bits */);
-}
-
 // Links tgt page to src physical frame
 void link_page(void *tgt, void *src) {
     KERNEL_ASSERT(
@@ -17,156 +12,528 @@ void link_page(void *tgt, void *src) {
     );
 }
 
-static void bytes_to_message_header(
-    MailboxMessageHeader *message_header, const void *data
-) {
-    pmemcpy(message_header, data, sizeof(MailboxMessageHeader));
+static u32 record_size(MailboxRecord *record) {
+    return sizeof(*record) + record->header.data_size;
 }
 
-static void bytes_to_message(MailboxMessage *message, const char *data) {
-    pmemcpy(&message->header, data, sizeof(MailboxMessageHeader));
-    pmemcpy(
-        &message->data, data + sizeof(MailboxMessageHeader),
-        message->header.data_size
-    );
+// Only usable from within the address space holding the mailbox. Records that
+// run past the end of the ring continue in the copy page.
+static MailboxRecord *record_at(MailboxHeader *mailbox, u32 offset) {
+    return mailbox->first_page + offset;
+}
+
+static u32 ring_next(MailboxHeader *mailbox, u32 offset, u32 size) {
+    return (offset + size) % mailbox->capacity;
+}
+
+static u32 mailbox_pages(MailboxHeader *mailbox) {
+    return mailbox->capacity / MAILBOX_DATA_SIZE;
+}
+
+// Points the kernel windows at the page holding `offset` and the page after it
+// in the ring, just like the copy page follows the last page. Lets up to a
+// page be written at `offset` from any address space.
+static void *ring_window(MailboxHeader *mailbox, u32 offset) {
+    u32 index = offset / PAGE_SIZE;
+    void *window = map_window(0, mailbox->frames[index]);
+    map_window(1, mailbox->frames[(index + 1) % mailbox_pages(mailbox)]);
+    return window + offset % PAGE_SIZE;
+}
+
+static void *status_page(MailboxHeader *mailbox) {
+    return mailbox->first_page - PAGE_SIZE;
+}
+
+// Marks the ring as changing for a process reading it from user space. Goes
+// through the kernel windows, so it works from any address space, but it
+// takes over window 0 until status_end.
+static void status_begin(MailboxHeader *mailbox) {
+    if (!mailbox->status_frame)
+        return;
+
+    MailboxStatus *status = map_window(0, mailbox->status_frame);
+    status->seq += 1;
+}
+
+static void status_end(MailboxHeader *mailbox) {
+    if (!mailbox->status_frame)
+        return;
+
+    MailboxStatus *status = map_window(0, mailbox->status_frame);
+    status->head = mailbox->head;
+    status->tail = mailbox->tail;
+    status->used_size = mailbox->used_size;
+    status->capacity = mailbox->capacity;
+    status->seq += 1;
+}
+
+static u32 chain_index(u32 sender_pid) {
+    return get_pid_aid(sender_pid) % MAILBOX_CHAINS;
+}
+
+static u32 lane_index(MailboxRecord *record) {
+    return MESSAGE_PRIORITY(record->header.flags);
+}
+
+// Empties the sender chains and the lanes
+static void chains_reset(MailboxHeader *mailbox) {
+    for (u32 i = 0; i < MAILBOX_CHAINS; ++i) {
+        mailbox->chain_head[i] = NO_RECORD;
+        mailbox->chain_tail[i] = NO_RECORD;
+    }
+
+    for (u32 i = 0; i < MAILBOX_LANES; ++i) {
+        mailbox->lane_head[i] = NO_RECORD;
+        mailbox->lane_tail[i] = NO_RECORD;
+    }
+}
+
+static void chain_append(MailboxHeader *mailbox, u32 offset) {
+    MailboxRecord *record = record_at(mailbox, offset);
+    u32 chain = chain_index(record->header.sender_pid);
+
+    record->next = NO_RECORD;
+    record->prev = mailbox->chain_tail[chain];
+    if (record->prev != NO_RECORD)
+        record_at(mailbox, record->prev)->next = offset;
+    else
+        mailbox->chain_head[chain] = offset;
+    mailbox->chain_tail[chain] = offset;
+}
+
+static void chain_unlink(MailboxHeader *mailbox, u32 offset) {
+    MailboxRecord *record = record_at(mailbox, offset);
+    u32 chain = chain_index(record->header.sender_pid);
+
+    if (record->prev != NO_RECORD)
+        record_at(mailbox, record->prev)->next = record->next;
+    else
+        mailbox->chain_head[chain] = record->next;
+
+    if (record->next != NO_RECORD)
+        record_at(mailbox, record->next)->prev = record->prev;
+    else
+        mailbox->chain_tail[chain] = record->prev;
+}
+
+static void lane_append(MailboxHeader *mailbox, u32 offset) {
+    MailboxRecord *record = record_at(mailbox, offset);
+    u32 lane = lane_index(record);
+
+    record->lane_next = NO_RECORD;
+    record->lane_prev = mailbox->lane_tail[lane];
+    if (record->lane_prev != NO_RECORD)
+        record_at(mailbox, record->lane_prev)->lane_next = offset;
+    else
+        mailbox->lane_head[lane] = offset;
+    mailbox->lane_tail[lane] = offset;
+}
+
+static void lane_unlink(MailboxHeader *mailbox, u32 offset) {
+    MailboxRecord *record = record_at(mailbox, offset);
+    u32 lane = lane_index(record);
+
+    if (record->lane_prev != NO_RECORD)
+        record_at(mailbox, record->lane_prev)->lane_next = record->lane_next;
+    else
+        mailbox->lane_head[lane] = record->lane_next;
+
+    if (record->lane_next != NO_RECORD)
+        record_at(mailbox, record->lane_next)->lane_prev = record->lane_prev;
+    else
+        mailbox->lane_tail[lane] = record->lane_prev;
+}
+
+// Links every unread message into its chain and lane again, after they were
+// moved.
+static void chains_rebuild(MailboxHeader *mailbox) {
+    u32 offset = mailbox->head;
+    u32 seen_size = 0;
+
+    chains_reset(mailbox);
+    while (seen_size < mailbox->used_size) {
+        MailboxRecord *record = record_at(mailbox, offset);
+        u32 size = record_size(record);
+
+        if (record->header.sender_pid) {
+            chain_append(mailbox, offset);
+            lane_append(mailbox, offset);
+        }
+
+        seen_size += size;
+        offset = ring_next(mailbox, offset, size);
+    }
 }
 
-// Cleans up read messages from mailbox
-u16 message_cleanup(MailboxHeader *mailbox) {
-    u16 cleaned_up_bytes = 0;
-    u16 seen_size = 0;
-    MailboxMessageHeader header;
-    void *tmp_header = mailbox->head;
-    bytes_to_message_header(&header, tmp_header);
-    while (header.sender_pid == 0 && header.reader_pid == 0 &&
-           seen_size < mailbox->used_size) {
-        cleaned_up_bytes += sizeof(MailboxMessageHeader) + header.data_size;
-        seen_size += cleaned_up_bytes;
-        tmp_header += cleaned_up_bytes;
-        bytes_to_message_header(&header, tmp_header);
+// Reclaims the holes at the head of the mailbox.
+static void message_cleanup(MailboxHeader *mailbox) {
+    while (mailbox->used_size) {
+        MailboxRecord *record = record_at(mailbox, mailbox->head);
+        if (record->header.sender_pid)
+            break;
+
+        u32 size = record_size(record);
+        mailbox->used_size -= size;
+        mailbox->dead_size -= size;
+        mailbox->head = ring_next(mailbox, mailbox->head, size);
+    }
+}
+
+// Slides the unread messages towards the head, over the holes left between
+// them. Messages only ever move back in the ring and pmemcpy copies forwards,
+// so overlapping moves are fine, even through the copy page.
+static void mailbox_compact(MailboxHeader *mailbox) {
+    u32 from = mailbox->head;
+    u32 to = mailbox->head;
+    u32 seen_size = 0;
+
+    while (seen_size < mailbox->used_size) {
+        MailboxRecord *record = record_at(mailbox, from);
+        u32 size = record_size(record);
+
+        if (record->header.sender_pid) {
+            if (to != from)
+                pmemcpy(record_at(mailbox, to), record, size);
+            to = ring_next(mailbox, to, size);
+        }
+
+        seen_size += size;
+        from = ring_next(mailbox, from, size);
     }
-    return cleaned_up_bytes;
+
+    mailbox->tail = to;
+    mailbox->used_size -= mailbox->dead_size;
+    mailbox->dead_size = 0;
+    chains_rebuild(mailbox);
 }
 
 void mailbox_init(
     MailboxHeader *mailbox, void *mailbox_start_addr, u16 page_flags
 ) {
     mailbox->capacity = MAILBOX_DATA_SIZE;
-    mailbox->unread_size = 0;
+    mailbox->dead_size = 0;
     mailbox->used_size = 0;
-    mailbox->head = mailbox_start_addr;
-    mailbox->tail = mailbox_start_addr;
+    mailbox->reserved_size = 0;
+    mailbox->head = 0;
+    mailbox->tail = 0;
     mailbox->first_page = mailbox_start_addr;
     mailbox->last_page = mailbox_start_addr;
     mailbox->copy_page = mailbox->last_page + PAGE_SIZE;
+    mailbox->page_flags = page_flags;
+    mailbox->status_frame = 0;
     alloc_page(mailbox_start_addr, page_flags);
     link_page(mailbox->copy_page, mailbox->first_page);
+    mailbox->frames[0] = get_paddr(get_entry(mailbox_start_addr));
+    chains_reset(mailbox);
 }
 
-// todo implement
+// Unmaps and frees all mailbox pages. Must be called from within the address
+// space holding the mailbox.
 void mailbox_del(MailboxHeader *mailbox) {
-    (void) mailbox;
-    // Should unmap and deallocate all mailbox pages for the given mailbox.
+    if (!mailbox->first_page)
+        return;
+
+    // The copy page maps the first page's frame a second time
+    KERNEL_ASSERT(!unmap_page(mailbox->copy_page, NULL));
+
+    free_pages(mailbox->first_page, mailbox_pages(mailbox));
+    if (mailbox->status_frame)
+        free_page(status_page(mailbox));
+    mailbox->first_page = NULL;
+}
+
+MailboxStatus *mailbox_map_user(MailboxHeader *mailbox) {
+    MailboxStatus *status = status_page(mailbox);
+    if (mailbox->status_frame)
+        return status;
+
+    alloc_page(status, PAGE_USER_MODE);
+    pmemset(status, 0, PAGE_SIZE);
+    status->data_offset = PAGE_SIZE;
+    mailbox->status_frame = get_paddr(get_entry(status));
+
+    // The kernel ignores write protection, so it keeps writing to the pages
+    // through the same mappings.
+    mailbox->page_flags = PAGE_USER_MODE;
+    u32 pages = mailbox_pages(mailbox);
+    for (u32 i = 0; i <= pages; ++i) {
+        void *page = mailbox->first_page + i * PAGE_SIZE;
+        KERNEL_ASSERT(!unmap_page(page, NULL));
+        KERNEL_ASSERT(!map_page(
+            page, mailbox->frames[i % pages], mailbox->page_flags
+        ));
+    }
+
+    status_begin(mailbox);
+    status_end(mailbox);
+    return status;
+}
+
+bool mailbox_region_overlaps(MailboxHeader *mailbox, u32 vaddr, u32 pages) {
+    if (!mailbox->first_page)
+        return false;
+
+    u32 start = (u32) status_page(mailbox);
+    u32 end = start + MAILBOX_REGION_PAGES * PAGE_SIZE;
+    return vaddr < end && start < vaddr + pages * PAGE_SIZE;
+}
+
+void mailbox_unmap_inherited(MailboxHeader *parent) {
+    // Fork took a reference on every frame, the copy page included
+    if (parent->status_frame)
+        free_pages(status_page(parent), mailbox_pages(parent) + 2);
 }
 
-// todo implement
-bool mailbox_grow(MailboxHeader *mailbox) {
-    (void) mailbox;
+// Holes are compacted away first, which may already make enough room. Then
+// the copy page is turned into a real page and more pages are added after it
+// as needed, and the copy page is mirrored again after the new last page. If
+// the messages wrap around the end of the ring, the wrapped part is moved into
+// the new pages so it follows the rest of the messages again.
+static bool mailbox_expand(MailboxHeader *mailbox, u32 size) {
+    if (mailbox->dead_size)
+        mailbox_compact(mailbox);
 
-    // potential implementation
-    // unmap copy page
-    // alloc new page at that address
-    // map next copy page to the following page
-    // increase capacities and such
+    u32 needed = mailbox->used_size + mailbox->reserved_size + size;
+    if (needed <= mailbox->capacity)
+        return true;
+
+    u32 pages = mailbox_pages(mailbox);
+    bool wrapped = mailbox->used_size && mailbox->tail <= mailbox->head;
+    u32 wrapped_size = wrapped ? mailbox->tail : 0;
+
+    u32 added = size_in_pages(needed - mailbox->capacity);
+    if (added < size_in_pages(wrapped_size))
+        added = size_in_pages(wrapped_size);
+    if (pages + added > MAILBOX_MAX_PAGES)
+        return false;
+
+    void *old_end = mailbox->copy_page;
+    KERNEL_ASSERT(!unmap_page(mailbox->copy_page, NULL));
+    alloc_pages(old_end, mailbox->page_flags, added);
+
+    for (u32 i = 0; i < added; ++i)
+        mailbox->frames[pages + i] =
+            get_paddr(get_entry(old_end + i * PAGE_SIZE));
+
+    mailbox->last_page = old_end + (added - 1) * PAGE_SIZE;
+    mailbox->copy_page = mailbox->last_page + PAGE_SIZE;
+    link_page(mailbox->copy_page, mailbox->first_page);
+
+    u32 old_capacity = mailbox->capacity;
+    mailbox->capacity += added * MAILBOX_DATA_SIZE;
+
+    if (wrapped) {
+        pmemcpy(old_end, mailbox->first_page, wrapped_size);
+        mailbox->tail = old_capacity + wrapped_size;
+        chains_rebuild(mailbox);
+    }
+
+    return true;
+}
+
+bool mailbox_grow(MailboxHeader *mailbox, u8 data_size) {
+    if (!mailbox->first_page)
+        return false;
+
+    status_begin(mailbox);
+    bool grew = mailbox_expand(mailbox, sizeof(MailboxRecord) + data_size);
+    status_end(mailbox);
+    return grew;
+}
+
+bool mailbox_reserve(MailboxHeader *mailbox, u32 size) {
+    if (!mailbox->first_page)
+        return false;
+
+    status_begin(mailbox);
+    bool grew = mailbox_expand(mailbox, size);
+    if (grew)
+        mailbox->reserved_size += size;
+    status_end(mailbox);
+    return grew;
+}
+
+void mailbox_unreserve(MailboxHeader *mailbox, u32 size) {
+    KERNEL_ASSERT(size <= mailbox->reserved_size);
+    mailbox->reserved_size -= size;
+}
+
+// Gives an empty mailbox back all but its first page. A mailbox mapped into
+// user space keeps its pages, its process may be reading them, and so does a
+// mailbox with room reserved.
+static void mailbox_shrink(MailboxHeader *mailbox) {
+    u32 pages = mailbox_pages(mailbox);
+
+    mailbox->head = 0;
+    mailbox->tail = 0;
+    mailbox->dead_size = 0;
+    chains_reset(mailbox);
+    if (pages == 1 || mailbox->status_frame || mailbox->reserved_size)
+        return;
 
-    return false; //* no-op
+    KERNEL_ASSERT(!unmap_page(mailbox->copy_page, NULL));
+    free_pages(mailbox->first_page + PAGE_SIZE, pages - 1);
+
+    mailbox->last_page = mailbox->first_page;
+    mailbox->copy_page = mailbox->last_page + PAGE_SIZE;
+    link_page(mailbox->copy_page, mailbox->first_page);
+    mailbox->capacity = MAILBOX_DATA_SIZE;
 }
 
 int mailbox_send_message(
-    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid, u8 data_size,
-    const void *data
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid, u8 flags,
+    u8 data_size, const void *data
 ) {
-    MailboxMessageHeader message_header;
-    message_header.sender_pid = sender_pid;
-    message_header.reader_pid = reader_pid;
-    message_header.data_size = data_size;
-    u32 message_header_size = sizeof(message_header);
-
-    // Resize mailbox if message is too large
-    if (mailbox->used_size + message_header_size + data_size >
-        mailbox->capacity) {
-        bool mailbox_grew = mailbox_grow(mailbox);
-        if (!mailbox_grew)
-            return false; // Mailbox at max capacity.
-    }
+    MailboxRecord record;
+    u32 size = sizeof(record) + data_size;
+
+    // Growing needs the mailbox's address space, which we may not be in
+    u32 taken = mailbox->used_size + mailbox->reserved_size;
+    if (taken + size > mailbox->capacity)
+        return false;
+
+    u32 offset = mailbox->tail;
+    u32 chain = chain_index(sender_pid);
+    u32 lane = MESSAGE_PRIORITY(flags);
+    status_begin(mailbox);
+
+    record.next = NO_RECORD;
+    record.prev = mailbox->chain_tail[chain];
+    record.lane_next = NO_RECORD;
+    record.lane_prev = mailbox->lane_tail[lane];
+    record.header.sender_pid = sender_pid;
+    record.header.reader_pid = reader_pid;
+    record.header.data_size = data_size;
+    record.header.flags = flags;
 
-    pmemcpy(mailbox->tail, &message_header, message_header_size);
-    mailbox->tail += message_header_size;
-    pmemcpy(mailbox->tail, data, data_size);
-    mailbox->tail += data_size;
+    // A message never spans more than two pages
+    char *window = ring_window(mailbox, offset);
+    pmemcpy(window, &record, sizeof(record));
+    pmemcpy(window + sizeof(record), data, data_size);
 
-    // Ensure tail is never on copypage
-    if (page_ptr(mailbox->tail) == mailbox->copy_page) {
-        u32 page_offset = ((u32) mailbox->tail << 20) >> 20;
-        mailbox->tail = mailbox->first_page + page_offset;
+    if (record.prev != NO_RECORD) {
+        MailboxRecord *prev = ring_window(mailbox, record.prev);
+        prev->next = offset;
     }
-    mailbox->used_size += message_header_size + data_size;
+    else {
+        mailbox->chain_head[chain] = offset;
+    }
+
+    if (record.lane_prev != NO_RECORD) {
+        MailboxRecord *prev = ring_window(mailbox, record.lane_prev);
+        prev->lane_next = offset;
+    }
+    else {
+        mailbox->lane_head[lane] = offset;
+    }
+
+    mailbox->chain_tail[chain] = offset;
+    mailbox->lane_tail[lane] = offset;
+    mailbox->tail = ring_next(mailbox, offset, size);
+    mailbox->used_size += size;
+    status_end(mailbox);
     return true;
 }
 
+// A tid of zero on either side refers to every thread of the process.
 bool match_pid(u32 field_pid, u32 target_pid) {
     if (field_pid == 0)
         return false;
     if (target_pid == 0)
         return true;
-    if (get_pid_tid(field_pid) == 0)
+    if (get_pid_tid(field_pid) == 0 || get_pid_tid(target_pid) == 0)
         return get_pid_aid(field_pid) == get_pid_aid(target_pid);
     return field_pid == target_pid;
 }
 
-int mailbox_read_message(
-    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid,
-    MailboxMessage *message
+static bool record_matches(
+    MailboxRecord *record, u32 sender_pid, u32 reader_pid
 ) {
-    // Search for message
-    u16 seen_size = 0;
-    char *current_message = mailbox->head;
-    u16 total_message_size = 0;
-    while (seen_size < mailbox->used_size) {
-        bytes_to_message_header(&message->header, current_message);
-        if (match_pid(message->header.sender_pid, sender_pid) &&
-            match_pid(message->header.reader_pid, reader_pid))
-            break;
-        total_message_size =
-            sizeof(MailboxMessageHeader) + message->header.data_size;
-        seen_size += total_message_size;
-        current_message += total_message_size;
+    return match_pid(record->header.sender_pid, sender_pid) &&
+           match_pid(record->header.reader_pid, reader_pid);
+}
+
+static u32 lane_find(
+    MailboxHeader *mailbox, u32 lane, u32 sender_pid, u32 reader_pid
+) {
+    u32 offset = mailbox->lane_head[lane];
+
+    while (offset != NO_RECORD) {
+        MailboxRecord *record = record_at(mailbox, offset);
+        if (record_matches(record, sender_pid, reader_pid))
+            return offset;
+        offset = record->lane_next;
     }
 
-    if (seen_size >= mailbox->used_size)
-        return 0;
+    return NO_RECORD;
+}
 
-    // Search read the message into message
-    bytes_to_message(message, current_message);
-    mailbox->unread_size -= total_message_size;
-    pmemset(current_message, 0, 8);
-
-    // Cleanup read messages
-    u16 clean_up_size = message_cleanup(mailbox);
-    mailbox->used_size -= clean_up_size;
-    mailbox->head += clean_up_size;
-    printk(DEBUG, "Cleanup size - %u\n", clean_up_size);
-
-    // Ensure head is never on copy page
-    if (page_ptr(mailbox->head) == mailbox->copy_page) {
-        u32 page_offset = ((u32) mailbox->head << 20) >> 20;
-        mailbox->head = mailbox->first_page + page_offset;
+// Finds the oldest message matching the pids in the highest lane holding one.
+// Holes never match. With a sender given only the urgent lanes are searched
+// lane by lane, the lowest one is left to the sender's chain since any match
+// in the chain is in the lowest lane by then.
+static u32 find_message(
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid
+) {
+    u32 last_lane = sender_pid ? 1 : 0;
+    for (u32 lane = MAILBOX_LANES; lane-- > last_lane;) {
+        u32 offset = lane_find(mailbox, lane, sender_pid, reader_pid);
+        if (offset != NO_RECORD)
+            return offset;
     }
 
-    return 1;
+    if (!sender_pid)
+        return NO_RECORD;
+
+    u32 offset = mailbox->chain_head[chain_index(sender_pid)];
+
+    while (offset != NO_RECORD) {
+        MailboxRecord *record = record_at(mailbox, offset);
+        if (record_matches(record, sender_pid, reader_pid))
+            return offset;
+        offset = record->next;
+    }
+
+    return NO_RECORD;
 }
 
-int send_signal(u8 signal_num) {
-    printk(DEBUG, "signal %u received...\n", signal_num);
-    return 0; // No-op for now
+bool mailbox_has_message(
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid
+) {
+    return find_message(mailbox, sender_pid, reader_pid) != NO_RECORD;
+}
+
+int mailbox_read_message(
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid,
+    MailboxMessage *message
+) {
+    u32 offset = find_message(mailbox, sender_pid, reader_pid);
+    if (offset == NO_RECORD)
+        return 0;
+
+    status_begin(mailbox);
+    MailboxRecord *record = record_at(mailbox, offset);
+    pmemcpy(&message->header, &record->header, sizeof(message->header));
+    pmemcpy(message->data, record + 1, record->header.data_size);
+
+    // Leave a hole behind
+    chain_unlink(mailbox, offset);
+    lane_unlink(mailbox, offset);
+    record->header.sender_pid = 0;
+    record->header.reader_pid = 0;
+    mailbox->dead_size += record_size(record);
+
+    message_cleanup(mailbox);
+
+    // Bursts grow the mailbox, which goes back to a single page once it has
+    // been drained. Holes are compacted away once they take up more room
+    // than the unread messages, so every read pays for a bounded amount of
+    // compaction.
+    if (!mailbox->used_size)
+        mailbox_shrink(mailbox);
+    else if (mailbox->dead_size > mailbox->used_size / 2)
+        mailbox_compact(mailbox);
+
+    status_end(mailbox);
+    return 1;
 }
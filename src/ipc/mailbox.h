@@ -9,24 +9,77 @@
 // Because ipc is still being worked on these functions may change drastically
 
 #define MAILBOX_DATA_SIZE PAGE_SIZE
+#define MAILBOX_MAX_PAGES 16
 #define MAX_MESSAGE_SIZE  255
+#define MAILBOX_CHAINS    16
+#define MAILBOX_LANES     4
+
+// Pages set aside for a mailbox: the status page, the data pages and the copy
+// page
+#define MAILBOX_REGION_PAGES (MAILBOX_MAX_PAGES + 2)
 
 // Send Message Syscall Flags
-#define IPC_SIGNAL (1 << 0)
+#define IPC_SIGNAL     (1 << 0) // Raise notification bit data[0] % 32 instead
+#define IPC_GRANT      (1 << 1) // The data is a PageGrant
+#define IPC_WAIT_SPACE (1 << 2) // Wait for room if the mailbox is full
+
+// Message Flags
+#define MESSAGE_GRANT (1 << 0) // The data is a PageGrant in the reader's space
+#define MESSAGE_TOPIC (1 << 1) // The data is a TopicMessage, see ipc/topic.h
+
+// Send and message flags carry the priority of a message in the same bits.
+// Reads take messages from the highest priority lane holding a match first.
+#define PRIORITY_SHIFT          6
+#define PRIORITY_MASK           ((MAILBOX_LANES - 1) << PRIORITY_SHIFT)
+#define IPC_PRIORITY(level)     ((level) << PRIORITY_SHIFT)
+#define MESSAGE_PRIORITY(flags) (((flags) & PRIORITY_MASK) >> PRIORITY_SHIFT)
+
+// Page Grant Flags, without any the pages are moved
+#define GRANT_SHARE        (1 << 0) // Share the pages copy-on-write
+#define GRANT_SHARE_MEMORY (1 << 1) // Share the pages writable by both sides
+
+#define GRANT_MAX_PAGES 4096
 
 // Read Message Syscall Flags
 #define IPC_BLOCKING (1 << 0)
 
+// Send, read and wait flags pick an endpoint in their upper byte, see
+// ipc/endpoint.h
+#define IPC_ENDPOINT_SHIFT     24
+#define IPC_ENDPOINT(id)       ((id) << IPC_ENDPOINT_SHIFT)
+#define IPC_ENDPOINT_ID(flags) ((flags) >> IPC_ENDPOINT_SHIFT)
+
+// Messages are kept in a ring, `head` and `tail` are offsets into it. Reading
+// a message that isn't at the head leaves a hole behind, which is reclaimed
+// once the head reaches it or the mailbox gets compacted.
 typedef struct {
-    void *head;
-    void *tail;
-    u16 unread_size;
-    u16 used_size;
-    u16 capacity;
+    u32 head;
+    u32 tail;
+    u32 dead_size; // Bytes taken by holes
+    u32 used_size;
+    u32 capacity;
+    u32 reserved_size; // Room promised to senders holding credits
+    u16 page_flags;
+    u32 status_frame; // Zero unless the mailbox is mapped into its process
     void *first_page;
     void *last_page;
     void *copy_page;
     // MailboxPage Structure should always be contigious.
+
+    // Frames backing the mailbox pages, so senders can reach the mailbox
+    // through the kernel windows without switching address spaces.
+    u32 frames[MAILBOX_MAX_PAGES];
+
+    // Every message is also linked into the chain of its sender, picked by
+    // the sender's aid, so reads filtered by sender only look at messages
+    // from senders sharing that chain. Oldest and newest message offsets.
+    u32 chain_head[MAILBOX_CHAINS];
+    u32 chain_tail[MAILBOX_CHAINS];
+
+    // Every message is also linked into the lane of its priority, oldest
+    // first, so reads find urgent messages without walking the bulk ones.
+    u32 lane_head[MAILBOX_LANES];
+    u32 lane_tail[MAILBOX_LANES];
 } MailboxHeader;
 
 typedef struct {
@@ -37,6 +90,7 @@ typedef struct __attribute__((packed)) {
     u32 sender_pid;
     u32 reader_pid;
     u8 data_size;
+    u8 flags;
 } MailboxMessageHeader;
 
 typedef struct __attribute__((packed)) {
@@ -44,6 +98,63 @@ typedef struct __attribute__((packed)) {
     char data[MAX_MESSAGE_SIZE];
 } MailboxMessage;
 
+#define NO_RECORD 0xFFFFFFFF
+
+// How a message is stored in the ring, followed by its data
+typedef struct __attribute__((packed)) {
+    u32 next; // Neighbours in the sender's chain, NO_RECORD at either end
+    u32 prev;
+    u32 lane_next; // Neighbours in the priority lane
+    u32 lane_prev;
+    MailboxMessageHeader header;
+} MailboxRecord;
+
+// Room a message takes in the ring on top of its data
+#define MESSAGE_OVERHEAD sizeof(MailboxRecord)
+
+// Once mapped with mailbox_map, a process can look for messages without a
+// syscall. The ring is mapped read-only `data_offset` bytes after the status
+// page, followed by a copy of its first page so no record is ever split. The
+// kernel brackets every change to the ring with `seq` like the clock page:
+//
+//     do {
+//         seq = status->seq;
+//         ... walk the records from head for used_size bytes ...
+//     } while (seq & 1 || seq != status->seq);
+//
+// Records with a zero sender are holes left by reads. Messages still have to
+// be consumed with read_message, which takes the oldest message of the
+// highest priority present when no sender is given. Sleeping until a message
+// arrives also still needs read_message or wait_events.
+typedef struct {
+    volatile u32 seq; // Odd while the kernel is changing the ring
+    volatile u32 head;
+    volatile u32 tail;
+    volatile u32 used_size;
+    volatile u32 capacity;
+    u32 data_offset;
+} MailboxStatus;
+
+// Sent with IPC_GRANT to hand pages to the reader. The kernel picks a region on
+// the reader's heap, maps the pages there while delivering the message and
+// rewrites `addr` to point at them.
+typedef struct {
+    void *addr; // Page aligned
+    u32 pages;
+    u32 flags;
+} PageGrant;
+
+#define MESSAGE_VEC_MAX 64
+
+// One message of a vectored send. The arguments match send_message.
+typedef struct {
+    u32 reader_pid;
+    u32 data_size;
+    const char *data;
+    u32 flags;
+    u32 status; // Written by the kernel, zero or the send_message error
+} MessageVec;
+
 _Static_assert(sizeof(MailboxPage) == PAGE_SIZE, "Mailbox size");
 
 void mailbox_init(
@@ -52,10 +163,49 @@ void mailbox_init(
 
 void mailbox_del(MailboxHeader *mailbox);
 
-// Sends a message to a mailbox
+// Maps the mailbox read-only into the address space holding it, behind a
+// status page. Must be called from within that address space. Returns the
+// address of the MailboxStatus.
+MailboxStatus *mailbox_map_user(MailboxHeader *mailbox);
+
+// Whether `pages` pages at `vaddr` overlap the region set aside for the
+// mailbox. `vaddr` and `pages` must be in user space.
+bool mailbox_region_overlaps(MailboxHeader *mailbox, u32 vaddr, u32 pages);
+
+// Drops the copy of a user mapped mailbox a forked address space inherited
+// from `parent`. Must be called from within the forked address space.
+void mailbox_unmap_inherited(MailboxHeader *parent);
+
+// Makes room in a mailbox for a message of `data_size` bytes, compacting it and
+// adding pages as needed. Must be called from within the address space holding
+// the mailbox. Returns false if the mailbox can't grow that much.
+bool mailbox_grow(MailboxHeader *mailbox, u8 data_size);
+
+// Sets `size` bytes of room aside, growing the mailbox as needed. Other
+// messages can't take that room until it is handed back with
+// mailbox_unreserve. Must be called from within the address space holding
+// the mailbox. Returns false if the mailbox can't grow that much.
+bool mailbox_reserve(MailboxHeader *mailbox, u32 size);
+
+// Hands reserved room back, so a message can be sent into it.
+void mailbox_unreserve(MailboxHeader *mailbox, u32 size);
+
+// Sends a message to a mailbox. Works from any address space, `data` only has
+// to be readable from the current one. Returns false if the mailbox is full,
+// see mailbox_grow.
 int mailbox_send_message(
-    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid, u8 data_size,
-    const void *data
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid, u8 flags,
+    u8 data_size, const void *data
+);
+
+// Whether a message's sender or reader pid `field_pid` matches the pid
+// `target_pid` asked for by a reader.
+bool match_pid(u32 field_pid, u32 target_pid);
+
+// Whether the mailbox holds a message read_message would return for these
+// pids. Must be called from within the address space holding the mailbox.
+bool mailbox_has_message(
+    MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid
 );
 
 // Reads messages from sender & reader of mailbox
@@ -64,7 +214,4 @@ int mailbox_read_message(
     MailboxMessage *message
 );
 
-// sends a signal to a process
-int send_signal(u8 signal_num);
-
 #endif // MAILBOX_H_
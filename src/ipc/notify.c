@@ -0,0 +1,54 @@
+#include "notify.h"
+#include "drivers/timer/timer.h"
+#include "ipc/mailbox.h"
+#include "lib/util.h"
+#include "syscall/syscall.h"
+
+void notify_signal(Process *proc, u32 bits) {
+    if (!bits)
+        return;
+
+    proc->notify_bits |= bits;
+    wake_all(&proc->notify_waiters);
+    wake_all(&proc->event_waiters);
+}
+
+#define NOTIFY_NOT_FOUND 1
+
+// Raises `bits` in the notification word of the process `pid` belongs to.
+SyscallResult syscall_notify_signal(u32 pid, u32 bits) {
+    Process *proc = get_process(get_pid_aid(pid));
+    if (!proc)
+        SYSCALL_RETURN(false, NOTIFY_NOT_FOUND);
+
+    notify_signal(proc, bits);
+    SYSCALL_RETURN(true, 0);
+}
+
+#define NOTIFY_TIMED_OUT 1
+
+// Takes and clears the pending bits of the current process. With IPC_BLOCKING
+// it waits until there are some, or until `timeout` milliseconds passed unless
+// it is zero. Several threads may wait, only the first one to run gets the
+// bits.
+SyscallResult syscall_notify_wait(u32 flags, u32 timeout) {
+    Process *proc = current->process;
+    u64 deadline = timeout ? timer_deadline_ms(timeout) : 0;
+
+    if (current->batched)
+        flags &= ~IPC_BLOCKING;
+
+    while (!proc->notify_bits && (flags & IPC_BLOCKING)) {
+        if (!thread_wait(&proc->notify_waiters, deadline))
+            SYSCALL_RETURN(0, NOTIFY_TIMED_OUT);
+    }
+
+    u32 bits = proc->notify_bits;
+    proc->notify_bits = 0;
+    SYSCALL_RETURN(bits, 0);
+}
+
+void notify_init() {
+    register_syscall(28, syscall_notify_signal);
+    register_syscall(29, syscall_notify_wait);
+}
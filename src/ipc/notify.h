@@ -0,0 +1,20 @@
+#ifndef NOTIFY_H_
+#define NOTIFY_H_
+
+#include "lib/types.h"
+#include "process/processes.h"
+
+// Every process has a notification word of 32 pending bits. Signalling a
+// process ORs bits into its word and wakes its waiters, and notify_wait takes
+// all pending bits at once and clears them. Events that arrive before the
+// process gets around to waiting are coalesced into a single wakeup, which
+// makes notifications a cheap way to forward interrupts, timers and other
+// events compared to a mailbox message.
+
+// Raises `bits` in the notification word of `proc`. Callable from anywhere in
+// the kernel with the kernel lock held.
+void notify_signal(Process *proc, u32 bits);
+
+void notify_init();
+
+#endif // NOTIFY_H_
@@ -0,0 +1,185 @@
+#include "topic.h"
+#include "ipc/mailbox.h"
+#include "lib/libp.h"
+#include "lib/util.h"
+#include "memory/heap.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "syscall/syscall.h"
+
+typedef struct {
+    bool used;
+    u32 subscriber_count;
+    u32 subscribers[TOPIC_MAX_SUBSCRIBERS]; // Process pids
+} Topic;
+
+// Topic ids are indices into this table plus one
+static Topic topics[TOPIC_MAX];
+
+static Topic *get_topic(u32 id) {
+    if (!id || id > TOPIC_MAX || !topics[id - 1].used)
+        return NULL;
+    return &topics[id - 1];
+}
+
+static u32 current_process_pid() {
+    return current->process->rb_node.key;
+}
+
+static void topic_remove_subscriber(Topic *topic, u32 index) {
+    topic->subscriber_count -= 1;
+    topic->subscribers[index] = topic->subscribers[topic->subscriber_count];
+}
+
+#define TOPIC_CREATE_FULL 1
+
+// Creates a topic and returns its id.
+SyscallResult syscall_topic_create() {
+    for (u32 i = 0; i < TOPIC_MAX; ++i) {
+        if (!topics[i].used) {
+            topics[i].used = true;
+            topics[i].subscriber_count = 0;
+            SYSCALL_RETURN(i + 1, 0);
+        }
+    }
+
+    SYSCALL_RETURN(0, TOPIC_CREATE_FULL);
+}
+
+#define TOPIC_NOT_FOUND 1
+#define TOPIC_FULL      2
+
+// Subscribes the current process to a topic. Subscribing twice does nothing.
+SyscallResult syscall_topic_subscribe(u32 id) {
+    Topic *topic = get_topic(id);
+    if (!topic)
+        SYSCALL_RETURN(false, TOPIC_NOT_FOUND);
+
+    u32 pid = current_process_pid();
+    for (u32 i = 0; i < topic->subscriber_count; ++i) {
+        if (topic->subscribers[i] == pid)
+            SYSCALL_RETURN(true, 0);
+    }
+
+    if (topic->subscriber_count == TOPIC_MAX_SUBSCRIBERS)
+        SYSCALL_RETURN(false, TOPIC_FULL);
+
+    topic->subscribers[topic->subscriber_count++] = pid;
+    SYSCALL_RETURN(true, 0);
+}
+
+SyscallResult syscall_topic_unsubscribe(u32 id) {
+    Topic *topic = get_topic(id);
+    if (!topic)
+        SYSCALL_RETURN(false, TOPIC_NOT_FOUND);
+
+    u32 pid = current_process_pid();
+    for (u32 i = 0; i < topic->subscriber_count; ++i) {
+        if (topic->subscribers[i] == pid) {
+            topic_remove_subscriber(topic, i);
+            break;
+        }
+    }
+
+    SYSCALL_RETURN(true, 0);
+}
+
+// Maps the payload onto the heap of `dst` and queues a TopicMessage for it.
+// Returns false if the subscriber has no room for either.
+static bool topic_deliver(
+    Process *dst, u32 pid, u32 id, void *payload, u32 size, u32 pages
+) {
+    TopicMessage message = {id, grant_region_alloc(dst, pages), size};
+    if (!message.addr)
+        return false;
+
+    Thread *receiver;
+    if (!deliver_message(
+            dst, &dst->mailbox, pid, MESSAGE_TOPIC, sizeof(message), &message,
+            &receiver
+        )) {
+        grant_region_free(dst, message.addr);
+        return false;
+    }
+
+    grant_pages(
+        dst->page_dir_paddr, message.addr, payload, pages, GRANT_MODE_READ_ONLY
+    );
+    return true;
+}
+
+#define TOPIC_PUBLISH_NOT_FOUND   1
+#define TOPIC_PUBLISH_INVALID_PTR 2
+
+// Sends `size` bytes at `data` to every subscriber of a topic. Subscribers that
+// are gone are dropped from the topic. Returns the number of subscribers that
+// got the payload, the others had a full mailbox or heap.
+SyscallResult syscall_topic_publish(u32 id, const void *data, u32 size) {
+    Topic *topic = get_topic(id);
+    if (!topic)
+        SYSCALL_RETURN(0, TOPIC_PUBLISH_NOT_FOUND);
+
+    u32 pages = size_in_pages(size);
+    if (!size || pages > TOPIC_MAX_PAGES ||
+        !validate_user_readable_range((u32) data, size))
+        SYSCALL_RETURN(0, TOPIC_PUBLISH_INVALID_PTR);
+
+    // The kernel holds on to the payload until every subscriber has it mapped
+    void *payload = kernel_alloc(pages);
+    pmemcpy(payload, data, size);
+    pmemset(payload + size, 0, pages * PAGE_SIZE - size);
+
+    u32 delivered = 0;
+    u32 i = 0;
+
+    while (i < topic->subscriber_count) {
+        u32 pid = topic->subscribers[i];
+        Process *dst = get_process(get_pid_aid(pid));
+
+        if (!dst) {
+            topic_remove_subscriber(topic, i);
+            continue;
+        }
+
+        delivered += topic_deliver(dst, pid, id, payload, size, pages);
+        i += 1;
+    }
+
+    kernel_free(payload);
+    SYSCALL_RETURN(delivered, 0);
+}
+
+u32 topic_payload_pages(Heap *heap, void *addr) {
+    u32 pages = heap_allocation_pages(heap, addr);
+    if (!pages || !granted_read_only(addr, pages))
+        return 0;
+    return pages;
+}
+
+#define TOPIC_RELEASE_INVALID_PTR 1
+
+// Unmaps the payload at `addr` from the heap of the current process. The
+// payload is freed once no subscriber has it mapped anymore. Anything but the
+// start of a payload mapping is rejected.
+SyscallResult syscall_topic_release(u32 addr) {
+    Heap *heap = &current->process->heap;
+    void *ptr = (void *) addr;
+
+    u32 pages = topic_payload_pages(heap, ptr);
+    if (!pages)
+        SYSCALL_RETURN(false, TOPIC_RELEASE_INVALID_PTR);
+
+    // Every page of the allocation is mapped, so all of them go and the heap
+    // never hands out pages that are still mapped
+    heap_free(heap, ptr);
+    free_pages(ptr, pages);
+    SYSCALL_RETURN(true, 0);
+}
+
+void topics_init() {
+    register_syscall(31, syscall_topic_create);
+    register_syscall(32, syscall_topic_subscribe);
+    register_syscall(33, syscall_topic_unsubscribe);
+    register_syscall(34, syscall_topic_publish);
+    register_syscall(35, syscall_topic_release);
+}
@@ -0,0 +1,31 @@
+#ifndef TOPIC_H_
+#define TOPIC_H_
+
+#include "lib/types.h"
+#include "memory/heap.h"
+
+// Topics broadcast a payload to every subscribed process without copying it
+// for each of them. topic_publish copies the payload once into kernel pages and
+// maps those pages read-only onto the heap of every subscriber, which then gets
+// a TopicMessage with MESSAGE_TOPIC set in its mailbox. The pages are reference
+// counted and freed once every subscriber has called topic_release on its
+// mapping.
+
+#define TOPIC_MAX             64
+#define TOPIC_MAX_SUBSCRIBERS 32
+#define TOPIC_MAX_PAGES       64
+
+typedef struct {
+    u32 topic;
+    void *addr; // Read-only payload on the subscriber's heap
+    u32 size;
+} TopicMessage;
+
+// Returns the number of pages of the payload mapped at `addr` on `heap`, or
+// zero if no payload mapping starts there. Must be called from within the
+// address space holding the heap.
+u32 topic_payload_pages(Heap *heap, void *addr);
+
+void topics_init();
+
+#endif // TOPIC_H_
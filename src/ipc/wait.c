@@ -0,0 +1,72 @@
+#include "wait.h"
+#include "drivers/timer/timer.h"
+#include "ipc/endpoint.h"
+#include "ipc/mailbox.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "syscall/syscall.h"
+
+static bool condition_holds(Process *proc, WaitCondition *condition) {
+    if (proc->notify_bits & condition->notify_mask)
+        return true;
+
+    if (!(condition->flags & WAIT_MESSAGE))
+        return false;
+
+    u32 endpoint = IPC_ENDPOINT_ID(condition->flags);
+    MailboxHeader *mailbox = endpoint_mailbox(proc, endpoint);
+    return mailbox && mailbox_has_message(
+                          mailbox, condition->sender_pid, condition->reader_pid
+                      );
+}
+
+// Marks the conditions that hold and returns how many do.
+static u32 check_conditions(
+    Process *proc, WaitCondition *conditions, u32 count
+) {
+    u32 fired = 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        conditions[i].fired = condition_holds(proc, &conditions[i]);
+        fired += conditions[i].fired;
+    }
+
+    return fired;
+}
+
+#define WAIT_EVENTS_INVALID_PTR 1
+#define WAIT_EVENTS_TOO_LARGE   2
+#define WAIT_EVENTS_TIMED_OUT   3
+
+// Blocks until at least one of `count` conditions holds, or until `timeout`
+// milliseconds passed unless it is zero. Sets `fired` on every condition and
+// returns the number of conditions that hold. Senders and notify_signal wake
+// every thread waiting here, which then checks its conditions again.
+SyscallResult
+syscall_wait_events(WaitCondition *conditions, u32 count, u32 timeout) {
+    if (!count || count > WAIT_EVENTS_MAX)
+        SYSCALL_RETURN(0, WAIT_EVENTS_TOO_LARGE);
+
+    Process *proc = current->process;
+    u64 deadline = timeout ? timer_deadline_ms(timeout) : 0;
+
+    for (;;) {
+        // Other threads may have unmapped the conditions while we slept
+        u32 size = count * sizeof(*conditions);
+        if (!validate_user_writable_range((u32) conditions, size))
+            SYSCALL_RETURN(0, WAIT_EVENTS_INVALID_PTR);
+
+        u32 fired = check_conditions(proc, conditions, count);
+        if (fired)
+            SYSCALL_RETURN(fired, 0);
+
+        if (!thread_wait(&proc->event_waiters, deadline))
+            SYSCALL_RETURN(0, WAIT_EVENTS_TIMED_OUT);
+    }
+}
+
+void wait_init() {
+    register_syscall(30, syscall_wait_events);
+
+    set_syscall_flags(30, SYSCALL_NO_BATCH);
+}
@@ -0,0 +1,28 @@
+#ifndef WAIT_H_
+#define WAIT_H_
+
+#include "lib/types.h"
+
+// wait_events lets a thread sleep until any of several conditions on its
+// process holds, so servers listening to several senders and notifications
+// don't have to poll them one by one. It only reports which conditions hold.
+// The thread then takes the messages and notification bits with read_message
+// and notify_wait as usual.
+
+#define WAIT_EVENTS_MAX 32
+
+// Wait Condition Flags
+#define WAIT_MESSAGE (1 << 0) // Holds while a matching message is queued,
+                              // in the endpoint given with IPC_ENDPOINT
+
+typedef struct {
+    u32 flags;
+    u32 sender_pid;  // Message filter, just like for read_message
+    u32 reader_pid;
+    u32 notify_mask; // Holds while any of these notification bits is pending
+    u32 fired;       // Written by the kernel, whether the condition holds
+} WaitCondition;
+
+void wait_init();
+
+#endif // WAIT_H_
@@ -1,5 +1,6 @@
 #include "init.h"
 #include "kernel/kernel.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
 #include "lib/libp.h"
 #include "lib/types.h"
@@ -10,12 +11,6 @@ extern void load_gdt(TablePointer *);
 extern void load_tss(u32 gdt_index);
 extern u32 get_eflags();
 
-SegmentDescriptor gdt[128];
-
-TablePointer gdt_ptr = {sizeof(gdt) - 1, gdt};
-
-Tss initial_tss;
-
 SegmentDescriptor
 make_segment_descriptor(u32 base, u32 limit, u8 type, u8 flags) {
     u64 descriptor = 0;
@@ -37,8 +32,12 @@ make_segment_descriptor(u32 base, u32 limit, u8 type, u8 flags) {
 
 #define SEGMENT(type, flags) make_segment_descriptor(0, 0xFFFFFFFF, type, flags)
 
-void init_gdt() {
-    for (int i = 0; i < 128; i++)
+// Builds and loads the GDT of `cpu`. Every cpu has the same layout, only the
+// TSS and thread local storage entries differ.
+void init_gdt(Cpu *cpu) {
+    SegmentDescriptor *gdt = cpu->gdt;
+
+    for (int i = 0; i < GDT_ENTRIES; i++)
         gdt[i] = make_segment_descriptor(0, 0, 0, 0);
 
     gdt[1] = SEGMENT((gdtpt_KernelCodeData << 4) | gdtseg_XR, gdtg_Page32);
@@ -46,19 +45,32 @@ void init_gdt() {
     gdt[3] = SEGMENT((gdtpt_UserCodeData << 4) | gdtseg_XR, gdtg_Page32);
     gdt[4] = SEGMENT((gdtpt_UserCodeData << 4) | gdtseg_RW, gdtg_Page32);
     gdt[5] = make_segment_descriptor(
-        (u32) &initial_tss, TSS_SIZE - 1,
+        (u32) &cpu->tss, TSS_SIZE - 1,
         (gdtpt_KernelSystem << 4) | gdtsys_Tss32A, gdtg_Byte16
     );
+    gdt[GDT_TLS_INDEX] =
+        SEGMENT((gdtpt_UserCodeData << 4) | gdtseg_RW, gdtg_Page32);
 
-    load_gdt(&gdt_ptr);
+    cpu->gdt_ptr = (TablePointer) {sizeof(cpu->gdt) - 1, gdt};
+    load_gdt(&cpu->gdt_ptr);
+}
+
+// Points the thread local storage segment of this cpu at `base` and reloads gs
+// so the change takes effect immediately.
+void set_tls_base(u32 base) {
+    this_cpu()->gdt[GDT_TLS_INDEX] = make_segment_descriptor(
+        base, 0xFFFFFFFF, (gdtpt_UserCodeData << 4) | gdtseg_RW, gdtg_Page32
+    );
+    load_tls();
 }
 
-void init_tss() {
-    pmemset(&initial_tss, 0, sizeof(initial_tss));
+void init_tss(Cpu *cpu) {
+    Tss *tss = &cpu->tss;
+    pmemset(tss, 0, sizeof(*tss));
 
-    initial_tss.ss0 = 0x10; // kernel data GDT entry
-    initial_tss.esp0 = (u32) kernel_stack;
-    initial_tss.io_base = TSS_SIZE;
+    tss->ss0 = 0x10; // kernel data GDT entry
+    tss->esp0 = (u32) cpu->kernel_stack;
+    tss->io_base = TSS_SIZE;
 
     load_tss(0x28); // TSS GDT entry
 }
@@ -92,6 +92,11 @@ typedef enum {
 } GdtSystemType;
 // clang-format on
 
+// User threads access their thread local storage through gs, which always holds
+// this selector. The base of the segment is swapped on every context switch.
+#define GDT_TLS_INDEX 6
+#define TLS_SELECTOR  ((GDT_TLS_INDEX << 3) | 3)
+
 // NOTE: OS Dev wiki documents this to be 104 bytes even though it seems to
 // actually be 108.
 #define TSS_SIZE 104
@@ -153,10 +158,32 @@ typedef struct __attribute__((aligned(8))) {
     u64 value;
 } SegmentDescriptor;
 
-void init_gdt();
-void init_tss();
+typedef struct {
+    u32 eax, ebx, ecx, edx;
+} CpuidRegs;
+
+#define CPUID_FEATURES 1
+
+#define CPUID_EDX_TSC (1 << 4)  // Time stamp counter
+#define CPUID_EDX_SEP (1 << 11) // SYSENTER/SYSEXIT
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+struct Cpu_;
+
+void init_gdt(struct Cpu_ *cpu);
+void init_tss(struct Cpu_ *cpu);
+void set_tls_base(u32 base);
 
 extern void init_fpu();
 extern u8 get_privilege_level();
+extern void load_tls();
+
+extern void write_msr(u32 msr, u32 lo, u32 hi);
+extern u64 read_msr(u32 msr);
+extern u64 read_tsc();
+extern void get_cpuid(u32 leaf, CpuidRegs *regs);
 
 #endif
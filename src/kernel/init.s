@@ -29,6 +29,12 @@ load_tss:
     ltr ax
     ret
 
+public load_tls
+load_tls:
+    mov ax, 0x33 ; thread local storage GDT entry with RPL = 3
+    mov gs, ax
+    ret
+
 public get_privilege_level
 get_privilege_level:
     mov ax, cs
@@ -40,3 +46,38 @@ get_eflags:
     pushfd
     pop eax
     ret
+
+public write_msr
+write_msr:
+    mov ecx, [esp+0x4]
+    mov eax, [esp+0x8]
+    mov edx, [esp+0xC]
+    wrmsr
+    ret
+
+public read_msr
+read_msr:
+    mov ecx, [esp+0x4]
+    rdmsr
+    ret
+
+public read_tsc
+read_tsc:
+    rdtsc
+    ret
+
+public get_cpuid
+get_cpuid:
+    push ebx
+    push edi
+    mov eax, [esp+0xC]
+    mov edi, [esp+0x10]
+    xor ecx, ecx
+    cpuid
+    mov [edi+0x0], eax
+    mov [edi+0x4], ebx
+    mov [edi+0x8], ecx
+    mov [edi+0xC], edx
+    pop edi
+    pop ebx
+    ret
@@ -4,13 +4,21 @@
 #include "drivers/serial/io.h"
 #include "drivers/timer/timer.h"
 #include "init.h"
+#include "kernel/smp.h"
 #include "interrupts/interrupt.h"
+#include "ipc/channel.h"
+#include "ipc/endpoint.h"
+#include "ipc/futex.h"
+#include "ipc/notify.h"
+#include "ipc/topic.h"
+#include "ipc/wait.h"
 #include "lib/error.h"
 #include "lib/logging.h"
 #include "lib/strings.h"
 #include "memory/mem.h"
 #include "process/processes.h"
 #include "sun/sun.h"
+#include "syscall/ring.h"
 #include "syscall/syscall.h"
 #include "terminal/terminal.h"
 #include "tests/testing.h"
@@ -39,14 +47,16 @@ void kernel_main(void) {
         (kernel_end_paddr - kernel_start_paddr) / 1024
     );
 
+    cpus_init();
+
     printk(DEBUG, "Initializing GDT...\n");
-    init_gdt();
+    init_gdt(&cpus[0]);
 
     printk(DEBUG, "Initializing IDT...\n");
     init_idt();
 
     printk(DEBUG, "Initializing TSS...\n");
-    init_tss();
+    init_tss(&cpus[0]);
 
     printk(DEBUG, "Initializing FPU...\n");
     init_fpu();
@@ -71,16 +81,20 @@ void kernel_main(void) {
 #endif
 
     syscalls_init();
+    rings_init();
     processes_init();
+    futex_init();
+    channels_init();
+    notify_init();
+    topics_init();
+    wait_init();
+    endpoints_init();
+
+    printk(DEBUG, "Starting application processors...\n");
+    smp_init();
 
     // Add your processes here
     // ex. exec_sun("binary.out", 0)
 
-    asm("sti");
-
-    schedule();
-
-    for (;;) {
-        asm("hlt");
-    }
+    cpu_idle();
 }
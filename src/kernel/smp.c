@@ -0,0 +1,218 @@
+#include "smp.h"
+#include "drivers/acpi/acpi.h"
+#include "drivers/apic/apic.h"
+#include "drivers/timer/timer.h"
+#include "interrupts/interrupt.h"
+#include "kernel/init.h"
+#include "kernel/kernel.h"
+#include "lib/error.h"
+#include "lib/libp.h"
+#include "lib/logging.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "syscall/syscall.h"
+
+// Physical address the AP trampoline is copied to. Must match smp.s.
+#define AP_TRAMPOLINE_ADDR 0x8000
+
+#define AP_STARTUP_ATTEMPTS   2
+#define AP_STARTUP_TIMEOUT_MS 100
+
+#define KERNEL_VADDR_START 0xC0000000
+
+#define NO_CPU 0xFFFFFFFF
+
+extern void *get_gdt_base();
+extern void flush_tlb();
+
+extern u8 ap_trampoline_start[];
+extern u8 ap_trampoline_cr3[];
+extern u8 ap_trampoline_stack[];
+extern u8 ap_trampoline_entry[];
+extern u8 ap_trampoline_end[];
+
+#define TRAMPOLINE_PARAM(label)                                                \
+    ((u32 *) (AP_TRAMPOLINE_ADDR + ((label) - ap_trampoline_start)))
+
+Cpu cpus[MAX_CPUS];
+u32 cpu_count = 0;
+
+static Spinlock big_lock;
+static volatile u32 lock_owner = NO_CPU;
+
+// The cpu that is currently running through the trampoline. Only one cpu is
+// started at a time.
+static Cpu *volatile booting_cpu = NULL;
+
+// The GDT of every cpu lives at the start of its Cpu struct, so the GDT base
+// register tells us which cpu we are on.
+Cpu *this_cpu() {
+    return get_gdt_base();
+}
+
+static void cpu_setup(Cpu *cpu, u32 id, void *kernel_stack) {
+    pmemset(cpu, 0, sizeof(*cpu));
+    cpu->id = id;
+    cpu->kernel_stack = kernel_stack;
+    queue_init(&cpu->run_queue);
+}
+
+// Sets up the bootstrap processor. Must be called before anything else touches
+// per cpu state, including init_gdt.
+void cpus_init() {
+    cpu_setup(&cpus[0], 0, (void *) kernel_stack);
+    cpus[0].online = true;
+    cpu_count = 1;
+
+    spin_init(&big_lock);
+}
+
+static void tlb_flush_local(Cpu *cpu) {
+    flush_tlb();
+    cpu->tlb_flush_pending = false;
+}
+
+void kernel_lock() {
+    Cpu *cpu = this_cpu();
+
+    while (!spin_try_lock(&big_lock)) {
+        // Whoever holds the lock may be waiting for us to flush our TLB, and
+        // we are spinning with interrupts disabled so the IPI can't get in.
+        if (cpu->tlb_flush_pending)
+            tlb_flush_local(cpu);
+        cpu_relax();
+    }
+
+    lock_owner = cpu->id;
+}
+
+void kernel_unlock() {
+    lock_owner = NO_CPU;
+    spin_unlock(&big_lock);
+}
+
+bool kernel_lock_held() {
+    return lock_owner == this_cpu()->id;
+}
+
+void smp_kick(Cpu *cpu) {
+    if (cpu != this_cpu())
+        lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+void tlb_shootdown(void *vaddr) {
+    if (cpu_count == 1)
+        return;
+
+    Cpu *self = this_cpu();
+    bool kernel_addr = (u32) vaddr >= KERNEL_VADDR_START;
+    u32 targets = 0;
+
+    // Kernel mappings are shared by every address space. User mappings can
+    // only be cached by cpus currently on the same page directory since every
+    // cr3 load flushes them.
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *cpu = &cpus[i];
+        if (cpu == self || !cpu->online)
+            continue;
+        if (!kernel_addr && cpu->page_dir != self->page_dir)
+            continue;
+
+        cpu->tlb_flush_pending = true;
+        lapic_send_ipi(cpu->apic_id, IPI_TLB_VECTOR);
+        targets |= 1 << i;
+    }
+
+    for (u32 i = 0; i < cpu_count; ++i) {
+        while ((targets & (1 << i)) && cpus[i].tlb_flush_pending)
+            cpu_relax();
+    }
+}
+
+static void tlb_flush_handler(InterruptRegisters *regs) {
+    (void) regs;
+    tlb_flush_local(this_cpu());
+}
+
+// Entry point of application processors once they reach the higher half. We
+// are on the cpu's own kernel stack but still on the trampoline's GDT.
+__attribute__((noreturn)) static void ap_main() {
+    Cpu *cpu = booting_cpu;
+
+    init_gdt(cpu);
+    init_tss(cpu);
+    reload_idt();
+    init_fpu();
+    lapic_init_ap();
+    init_timer_ap();
+    init_sysenter_cpu();
+
+    cpu->page_dir = kernel_page_dir;
+    cpu->online = true;
+
+    kernel_lock();
+    cpu_idle();
+}
+
+static bool start_ap(Cpu *cpu) {
+    *TRAMPOLINE_PARAM(ap_trampoline_cr3) = kernel_page_dir;
+    *TRAMPOLINE_PARAM(ap_trampoline_stack) = (u32) cpu->kernel_stack;
+    *TRAMPOLINE_PARAM(ap_trampoline_entry) = (u32) ap_main;
+    booting_cpu = cpu;
+
+    lapic_send_init(cpu->apic_id);
+    pit_wait_ms(10);
+
+    for (u32 i = 0; i < AP_STARTUP_ATTEMPTS && !cpu->online; ++i) {
+        lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE_ADDR);
+
+        for (u32 ms = 0; ms < AP_STARTUP_TIMEOUT_MS && !cpu->online; ++ms)
+            pit_wait_ms(1);
+    }
+
+    return cpu->online;
+}
+
+// Brings up every processor listed by the firmware. The calling cpu takes the
+// kernel lock and keeps it until it first schedules, so the application
+// processors wait until the boot cpu is done setting things up.
+void smp_init() {
+    u32 apic_ids[MAX_CPUS];
+    u32 lapic_paddr;
+
+    kernel_lock();
+
+    if (!lapic_supported())
+        return;
+
+    u32 count = acpi_find_cpus(apic_ids, MAX_CPUS, &lapic_paddr);
+    if (count < 2)
+        return;
+
+    lapic_init(lapic_paddr);
+    lapic_install_handler(IPI_TLB_VECTOR, tlb_flush_handler);
+    cpus[0].apic_id = lapic_id();
+
+    u32 size = ap_trampoline_end - ap_trampoline_start;
+    pmemcpy((void *) AP_TRAMPOLINE_ADDR, ap_trampoline_start, size);
+
+    for (u32 i = 0; i < count; ++i) {
+        if (apic_ids[i] == cpus[0].apic_id)
+            continue;
+
+        Cpu *cpu = &cpus[cpu_count];
+        void *stack = kernel_alloc(AP_STACK_PAGES);
+        cpu_setup(cpu, cpu_count, stack + AP_STACK_PAGES * PAGE_SIZE);
+        cpu->apic_id = apic_ids[i];
+
+        if (start_ap(cpu)) {
+            cpu_count += 1;
+        }
+        else {
+            printk(DEBUG, "CPU with APIC id %u did not start\n", apic_ids[i]);
+            kernel_free(stack);
+        }
+    }
+
+    printk(DEBUG, "%u CPUs online\n", cpu_count);
+}
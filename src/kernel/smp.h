@@ -0,0 +1,67 @@
+#ifndef SMP_H_
+#define SMP_H_
+
+#include "kernel/init.h"
+#include "lib/spinlock.h"
+#include "lib/types.h"
+#include "process/queue.h"
+
+#define MAX_CPUS 8
+
+#define GDT_ENTRIES 128
+
+// Pages of kernel stack given to each application processor. The bootstrap
+// processor keeps the stack set up in boot.s.
+#define AP_STACK_PAGES 4
+
+// State owned by a single cpu. Every cpu loads its own GDT so it can have its
+// own TSS and thread local storage segment under the same selectors. That also
+// gives us a cheap way to find the cpu we are running on, see this_cpu.
+typedef struct Cpu_ Cpu;
+struct Cpu_ {
+    // NOTE: this must stay the first member, this_cpu relies on it.
+    SegmentDescriptor gdt[GDT_ENTRIES];
+    TablePointer gdt_ptr;
+
+    u32 id; // Index into cpus
+    u32 apic_id;
+    volatile bool online;
+    volatile bool idle;
+
+    struct Thread_ *thread;      // Thread running on this cpu
+    struct Thread_ *idle_thread; // Runs when there is nothing else to do
+    struct Thread_ *dead_thread; // Exited thread waiting to be freed
+    u32 page_dir;                // Should mirror cr3
+    Queue run_queue;             // Protected by the kernel lock
+    u32 sched_ticks_left;        // Local timer ticks until the next preemption
+    volatile bool need_resched;  // Switch threads on the way to user mode
+    void *kernel_stack;          // Top of the stack the cpu booted on
+
+    volatile bool tlb_flush_pending;
+
+    Tss tss;
+};
+
+extern Cpu cpus[MAX_CPUS];
+extern u32 cpu_count;
+
+Cpu *this_cpu();
+
+void cpus_init();
+void smp_init();
+
+// All kernel code except interrupt entry, idle polling and TLB shootdowns runs
+// with the kernel lock held. It is taken on every entry from user mode and
+// released right before returning to user mode.
+void kernel_lock();
+void kernel_unlock();
+bool kernel_lock_held();
+
+// Wakes up `cpu` if it is idle so it can pick up new work.
+void smp_kick(Cpu *cpu);
+
+// Makes sure no cpu that may be using the mapping at `vaddr` keeps a stale TLB
+// entry for it. The local TLB must already have been invalidated.
+void tlb_shootdown(void *vaddr);
+
+#endif // SMP_H_
@@ -0,0 +1,85 @@
+format ELF
+
+section ".text" executable
+
+;; Returns the base of the GDT loaded on this cpu. Every cpu has its own GDT
+;; embedded at the start of its Cpu struct.
+public get_gdt_base
+get_gdt_base:
+    sub esp, 8
+    sgdt [esp]
+    mov eax, [esp+0x2]
+    add esp, 8
+    ret
+
+AP_TRAMPOLINE = 0x8000 ; Must match AP_TRAMPOLINE_ADDR in smp.c
+
+;; Application processor startup code. This is never executed from here. It is
+;; copied to AP_TRAMPOLINE in identity mapped low memory and the startup IPI
+;; starts application processors there in real mode. Everything between the
+;; start and end labels must be position independent, so absolute addresses are
+;; computed relative to AP_TRAMPOLINE by hand.
+;; The BSP fills in the three parameters at the end before starting each cpu.
+public ap_trampoline_start
+ap_trampoline_start:
+use16
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [AP_TRAMPOLINE + (ap_gdt_ptr - ap_trampoline_start)]
+
+    mov eax, cr0
+    and eax, not 0x60000000 ; the cpu comes out of INIT with caching disabled
+    or eax, 1               ; protected mode
+    mov cr0, eax
+    jmp 0x08:(AP_TRAMPOLINE + (ap_protected - ap_trampoline_start))
+
+use32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, cr4 ; enable global pages
+    or eax, 1 shl 7
+    mov cr4, eax
+
+    mov eax, [AP_TRAMPOLINE + (ap_trampoline_cr3 - ap_trampoline_start)]
+    mov cr3, eax
+
+    mov eax, cr0 ; enable paging
+    or eax, 0x80000000
+    mov cr0, eax
+
+    ; We are still running from the identity map of low memory, so jump to the
+    ; higher half through a register.
+    mov esp, [AP_TRAMPOLINE + (ap_trampoline_stack - ap_trampoline_start)]
+    mov eax, [AP_TRAMPOLINE + (ap_trampoline_entry - ap_trampoline_start)]
+    jmp eax
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF ; flat kernel code
+    dq 0x00CF92000000FFFF ; flat kernel data
+ap_gdt_ptr:
+    dw 3 * 8 - 1
+    dd AP_TRAMPOLINE + (ap_gdt - ap_trampoline_start)
+
+align 4
+public ap_trampoline_cr3
+ap_trampoline_cr3:
+    dd 0
+public ap_trampoline_stack
+ap_trampoline_stack:
+    dd 0
+public ap_trampoline_entry
+ap_trampoline_entry:
+    dd 0
+
+public ap_trampoline_end
+ap_trampoline_end:
@@ -0,0 +1,26 @@
+#include "spinlock.h"
+
+void spin_init(Spinlock *lock) {
+    lock->locked = 0;
+}
+
+void spin_lock(Spinlock *lock) {
+    while (!spin_try_lock(lock)) {
+        // Spin on a plain read so we don't bounce the cache line around with
+        // locked instructions while someone else holds the lock.
+        while (lock->locked)
+            cpu_relax();
+    }
+}
+
+bool spin_try_lock(Spinlock *lock) {
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+void spin_unlock(Spinlock *lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+void cpu_relax() {
+    asm volatile("pause" ::: "memory");
+}
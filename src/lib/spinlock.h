@@ -0,0 +1,18 @@
+#ifndef SPINLOCK_H_
+#define SPINLOCK_H_
+
+#include "lib/types.h"
+
+typedef struct {
+    volatile u32 locked;
+} Spinlock;
+
+void spin_init(Spinlock *lock);
+void spin_lock(Spinlock *lock);
+bool spin_try_lock(Spinlock *lock);
+void spin_unlock(Spinlock *lock);
+
+// Hints to the cpu that we are in a busy wait loop.
+void cpu_relax();
+
+#endif // SPINLOCK_H_
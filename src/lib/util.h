@@ -10,6 +10,11 @@ extern char temp_buffer[TEMP_BUFFER_LENGTH];
 extern u8 inb(u16 port);
 extern void outb(u16 port, u8 data);
 
+// Gets the structure of type `parent_type` embedding `field_ptr` as
+// `field_name`.
+#define FIELD_PARENT_PTR(parent_type, field_name, field_ptr)                   \
+    ((parent_type *) ((u8 *) field_ptr - offsetof(parent_type, field_name)))
+
 u16 get_pid_aid(u32 pid);
 u16 get_pid_tid(u32 pid);
 
@@ -29,6 +29,11 @@ void heap_set_usage(Heap *heap, u32 index, u8 usage) {
     u32 byte_idx = index / 4;
     u32 bit_pair_idx = 6 - 2 * (index % 4);
 
+    // The usage map of a process heap lives in process memory that may be
+    // shared with a forked process, and the kernel writes to it without
+    // faulting.
+    resolve_cow(&heap->usage_map[byte_idx]);
+
     heap->usage_map[byte_idx] =
         (heap->usage_map[byte_idx] & ~((u8) 0b11 << bit_pair_idx)) |
         (usage << bit_pair_idx);
@@ -98,8 +103,8 @@ void heap_init(Heap *heap, void *heap_start, u32 page_count, u16 flags) {
 }
 
 // Finds a large enough space on the heap to allocate some memory. Uses first
-// fit.
-void *heap_alloc(Heap *heap, u32 pages) {
+// fit. Returns NULL if there is no such space.
+void *heap_try_alloc(Heap *heap, u32 pages) {
     u32 space = 0;
     u32 start = 0;
 
@@ -120,12 +125,20 @@ void *heap_alloc(Heap *heap, u32 pages) {
         }
     }
 
+    return NULL;
+}
+
+void *heap_alloc(Heap *heap, u32 pages) {
+    void *ptr = heap_try_alloc(heap, pages);
+
     // NOTE: For now we will just panic if we run out of address space. Really
-    // we should propagate some kind of error upwards, maybe by returning a null
-    // pointer, since running out of memory is not a fatal error. We can
-    // mitigate this case with a better page allocation algorithm.
+    // we should propagate some kind of error upwards, since running out of
+    // memory is not a fatal error. Callers that can handle it use
+    // heap_try_alloc. We can mitigate this case with a better page allocation
+    // algorithm.
 
-    KERNEL_ASSERT(false); // No suitable allocation space
+    KERNEL_ASSERT(ptr); // No suitable allocation space
+    return ptr;
 }
 
 // Reallocates some memory. Returns the size of the old allocation.
@@ -216,6 +229,28 @@ void heap_debug(Heap *heap, u32 pages) {
     terminal_putchar('\n');
 }
 
+// Returns the number of pages of the allocation starting at `addr`, or zero if
+// no allocation starts there.
+u32 heap_allocation_pages(Heap *heap, void *addr) {
+    void *heap_end = heap->heap_start + heap->page_count * PAGE_SIZE;
+    if (!is_page_aligned(addr) || addr < heap->heap_start || addr >= heap_end)
+        return 0;
+
+    u32 start = (addr - heap->heap_start) / PAGE_SIZE;
+    u8 color = heap_get_usage(heap, start);
+    if (color == HEAP_PAGE_FREE)
+        return 0;
+    if (start && heap_get_usage(heap, start - 1) == color)
+        return 0;
+
+    u32 pages = 0;
+    while (start + pages < heap->page_count &&
+           heap_get_usage(heap, start + pages) == color)
+        pages += 1;
+
+    return pages;
+}
+
 // Determines if a given address on `heap` is currently in use.
 bool heap_is_used(Heap *heap, void *addr) {
     u32 i = (addr - heap->heap_start) / PAGE_SIZE;
@@ -28,10 +28,12 @@ typedef struct {
 void heap_init(Heap *heap, void *heap_start, u32 page_count, u16 flags);
 
 void *heap_alloc(Heap *heap, u32 pages);
+void *heap_try_alloc(Heap *heap, u32 pages);
 u32 heap_realloc(Heap *heap, void *ptr, void **new_ptr, u32 pages);
 u32 heap_free(Heap *heap, void *ptr);
 
 void heap_debug(Heap *heap, u32 pages);
 bool heap_is_used(Heap *heap, void *addr);
+u32 heap_allocation_pages(Heap *heap, void *addr);
 
 #endif // HEAP_H_
@@ -1,6 +1,7 @@
 #include "mem.h"
 #include "boot/multiboot.h"
 #include "kernel/kernel.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
 #include "lib/libp.h"
 #include "lib/logging.h"
@@ -40,6 +41,14 @@ u32 *page_table_entries = (u32 *) 0xFFC00000;
 #define PTE_WRITABLE  2   // Can user write?
 #define PTE_GLOBAL    512 // Flush from TLB on CR3 reload?
 
+// Available to software. Set on user pages that are shared with another address
+// space and become writable once this one has its own copy, see resolve_cow.
+#define PTE_COPY_ON_WRITE 1024
+
+// Available to software. Set on pages mapped by read-only grants, which are
+// the only pages topic_release takes back.
+#define PTE_READ_ONLY_GRANT 2048
+
 // Flags for memory mapping from a syscall. We don't have user mode flags here
 // since the user can only map user-mode pages.
 #define VIRT_MAP_WRITABLE 1
@@ -57,8 +66,18 @@ u32 *free_list_head_pte = NULL;
 u32 free_frame_paddr = 0;
 u32 used_frames = 0;
 u32 total_frames = 0;
+u32 frames_end = 0; // End of the highest frame given to the allocator
+
+// Extra references to allocated frames, indexed by frame number. Zero means the
+// frame has a single owner, which is the case for everything but user pages
+// shared by fork.
+u16 *frame_refs = NULL;
 
-u32 current_page_dir; // Should mirror cr3
+// Kernel pages that get pointed at arbitrary frames to reach memory that isn't
+// mapped anywhere else, like the page tables of another address space. They
+// are only used with the kernel lock held and every cpu invalidates its own TLB
+// entry before using one, so moving a window never needs a shootdown.
+void *windows = NULL;
 
 Heap kernel_heap;
 Heap user_ro_heap;
@@ -134,14 +153,15 @@ static void flush_entry_info(EntryInfo e) {
 }
 
 void set_page_dir(u32 paddr) {
-    if (paddr != current_page_dir) {
+    Cpu *cpu = this_cpu();
+    if (paddr != cpu->page_dir) {
         set_cr3(paddr);
-        current_page_dir = paddr;
+        cpu->page_dir = paddr;
     }
 }
 
 u32 get_page_dir() {
-    return current_page_dir;
+    return this_cpu()->page_dir;
 }
 
 void init_page_table(u32 *table) {
@@ -164,6 +184,9 @@ void free_frame(u32 paddr) {
 u32 alloc_frame() {
     KERNEL_ASSERT(free_frame_paddr); // are we out of memory?
     ++used_frames;
+    // Another cpu may have moved the free list window since we last looked
+    // through it, so our TLB entry for it could be stale.
+    invalidate_page(free_list_head);
     u32 frame = free_frame_paddr;
     free_frame_paddr = *free_list_head;
     *free_list_head_pte = create_entry(free_frame_paddr, PTE_WRITABLE);
@@ -171,6 +194,22 @@ u32 alloc_frame() {
     return frame;
 }
 
+// Adds a reference to a frame that is about to be mapped a second time.
+static void frame_ref(u32 paddr) {
+    u16 *refs = &frame_refs[paddr / PAGE_SIZE];
+    KERNEL_ASSERT(*refs != 0xFFFF);
+    *refs += 1;
+}
+
+// Drops a reference to a frame and frees it if that was the last one.
+static void frame_release(u32 paddr) {
+    u16 *refs = &frame_refs[paddr / PAGE_SIZE];
+    if (*refs)
+        *refs -= 1;
+    else
+        free_frame(paddr);
+}
+
 void print_frame_usage() {
     printk(INFO, "Usage: %u/%u\n", used_frames, total_frames);
 }
@@ -219,6 +258,7 @@ RESULT unmap_page(void *vaddr, u32 *entry) {
     info.entry = 0;
     flush_entry_info(info);
     invalidate_page(vaddr);
+    tlb_shootdown(vaddr);
 
     return false;
 }
@@ -240,6 +280,8 @@ void swap_page_frames(void *vaddr1, void *vaddr2) {
 
     invalidate_page(vaddr1);
     invalidate_page(vaddr2);
+    tlb_shootdown(vaddr1);
+    tlb_shootdown(vaddr2);
 }
 
 // Maps a series of pages to virtual memory.
@@ -275,9 +317,9 @@ void alloc_pages(void *vaddr, u16 flags, u32 count) {
 
 // Frees page at a given virtual address & frees underlying frame
 void free_page(void *vaddr) {
-    u32 paddr;
-    KERNEL_ASSERT(!unmap_page(vaddr, &paddr));
-    free_frame(paddr);
+    u32 entry;
+    KERNEL_ASSERT(!unmap_page(vaddr, &entry));
+    frame_release(get_paddr(entry));
 }
 
 // Frees pages starting at a given virtual address. Also frees the underlying
@@ -286,7 +328,7 @@ void free_pages(void *vaddr, u32 count) {
     while (count--) {
         u32 entry;
         KERNEL_ASSERT(!unmap_page(vaddr, &entry));
-        free_frame(get_paddr(entry));
+        frame_release(get_paddr(entry));
         vaddr += PAGE_SIZE;
     }
 }
@@ -387,6 +429,9 @@ void init_frame_region(u32 start_addr, u32 end_addr) {
         ++used_frames;
         free_frame(f);
     }
+
+    if (end_addr > frames_end)
+        frames_end = end_addr;
 }
 
 // Initializes free frame list using all available frames
@@ -442,6 +487,26 @@ void init_frames() {
     }
 }
 
+// Gives every kernel page directory entry a page table up front. New page
+// directories copy the kernel entries when they are created, so a page table
+// added later would be missing from every existing address space. Kernel
+// stacks in particular have to be mapped everywhere.
+static void init_kernel_page_tables(void *user_ro_addr) {
+    u32 user_ro_pdi = get_pd_index(user_ro_addr);
+
+    for (u32 pdi = KERNEL_PDI_START; pdi < KERNEL_PDI_END; ++pdi) {
+        if (entry_present(PDE(pdi)))
+            continue;
+
+        u16 flags = PDE_WRITABLE;
+        if (pdi >= user_ro_pdi)
+            flags |= PDE_USER_MODE;
+
+        PDE(pdi) = create_entry(alloc_frame(), flags);
+        init_page_table(get_page_table(pdi));
+    }
+}
+
 // Initializes the kernel heap, giving it all pages after the free list page and
 // before the page tables.
 void init_heap() {
@@ -455,6 +520,8 @@ void init_heap() {
     u32 kernel_page_count = page_count - USER_RO_PAGES;
     void *user_ro_addr = heap_addr + kernel_page_count * PAGE_SIZE;
 
+    init_kernel_page_tables(user_ro_addr);
+
     u16 kernel_flags = PAGE_WRITABLE | PAGE_GLOBAL;
     u16 user_flags = PAGE_WRITABLE | PAGE_USER_MODE | PAGE_GLOBAL;
 
@@ -462,6 +529,33 @@ void init_heap() {
     heap_init(&user_ro_heap, user_ro_addr, USER_RO_PAGES, user_flags);
 }
 
+// Sets up the frame reference counts and the windows. Needs the kernel heap.
+static void init_frame_sharing() {
+    u32 frame_count = frames_end / PAGE_SIZE;
+    u32 refs_size = frame_count * sizeof(*frame_refs);
+
+    frame_refs = kernel_alloc(size_in_pages(refs_size));
+    pmemset(frame_refs, 0, refs_size);
+
+    // The windows start out on frame zero so the heap bookkeeping sees them as
+    // mapped.
+    windows = heap_alloc(&kernel_heap, WINDOW_COUNT);
+    map_pages(windows, 0, PAGE_WRITABLE, WINDOW_COUNT);
+}
+
+// Points window `index` at the frame `paddr` and returns its address. The
+// windows are consecutive pages, so neighbouring windows can be used to see
+// frames that aren't contiguous as one range.
+void *map_window(u32 index, u32 paddr) {
+    KERNEL_ASSERT(index < WINDOW_COUNT);
+
+    void *vaddr = windows + index * PAGE_SIZE;
+    PTE(get_pd_index(vaddr), get_pt_index(vaddr)) =
+        create_entry(paddr, PTE_WRITABLE);
+    invalidate_page(vaddr);
+    return vaddr;
+}
+
 // Allocates a given number of pages on the heap. Empty allocations are not
 // allowed.
 void *mem_alloc(Heap *heap, u32 pages, u16 flags) {
@@ -510,6 +604,24 @@ void mem_free(Heap *heap, void *ptr) {
 
 // Kernel heap allocator
 
+// Maps `size` bytes of physical memory starting at `paddr` into the kernel heap
+// and returns the virtual address of `paddr`. The frames don't come from the
+// frame allocator, so this is meant for firmware tables and device registers.
+void *map_physical(u32 paddr, u32 size, u16 flags) {
+    u32 offset = paddr % PAGE_SIZE;
+    u32 pages = size_in_pages(offset + size);
+    void *vaddr = heap_alloc(&kernel_heap, pages);
+    map_pages(vaddr, paddr - offset, flags, pages);
+    return vaddr + offset;
+}
+
+void unmap_physical(void *vaddr, u32 size) {
+    u32 offset = (u32) vaddr % PAGE_SIZE;
+    u32 pages = size_in_pages(offset + size);
+    unmap_pages(vaddr - offset, pages);
+    heap_free(&kernel_heap, vaddr - offset);
+}
+
 void *kernel_alloc(u32 pages) {
     return mem_alloc(&kernel_heap, pages, PAGE_WRITABLE);
 }
@@ -572,19 +684,67 @@ void *validate_user_readable(u32 vaddr) {
         return NULL;
 }
 
-// Checks if a given pointer is writeable in userspace.
+// Checks if every page overlapping `size` bytes at `vaddr` is readable in
+// userspace. `size` must not be zero.
+void *validate_user_readable_range(u32 vaddr, u32 size) {
+    u32 last = vaddr + size - 1;
+    if (last < vaddr)
+        return NULL;
+
+    u32 first_page = vaddr & ~0xFFF;
+    u32 pages = ((last & ~0xFFF) - first_page) / PAGE_SIZE + 1;
+
+    for (u32 i = 0; i < pages; ++i) {
+        if (!validate_user_readable(first_page + i * PAGE_SIZE))
+            return NULL;
+    }
+
+    return (void *) vaddr;
+}
+
+// Whether `pages` pages at `vaddr` lie below the kernel part of the address
+// space. Pages above it, like the syscall trampolines and the clock page, may
+// be readable by users but belong to every process.
+bool in_user_space(u32 vaddr, u32 pages) {
+    u32 end = KERNEL_PDI_START << 22;
+    return vaddr < end && pages <= (end - vaddr) / PAGE_SIZE;
+}
+
+// Checks if a given pointer is writeable in userspace. The kernel ignores write
+// protection, so copy-on-write pages are copied here before we hand them out.
 void *validate_user_writable(u32 vaddr) {
     u32 entry = get_entry((void *) vaddr);
     u32 present = entry_present(entry);
     u32 user_mode = entry & PTE_USER_MODE;
     u32 writable = entry & PTE_WRITABLE;
 
+    if (present && user_mode && (entry & PTE_COPY_ON_WRITE))
+        writable = resolve_cow((void *) vaddr);
+
     if (present && user_mode && writable)
         return (void *) vaddr;
     else
         return NULL;
 }
 
+// Checks if every page overlapping `size` bytes at `vaddr` is writeable in
+// userspace. `size` must not be zero.
+void *validate_user_writable_range(u32 vaddr, u32 size) {
+    u32 last = vaddr + size - 1;
+    if (last < vaddr)
+        return NULL;
+
+    u32 first_page = vaddr & ~0xFFF;
+    u32 pages = ((last & ~0xFFF) - first_page) / PAGE_SIZE + 1;
+
+    for (u32 i = 0; i < pages; ++i) {
+        if (!validate_user_writable(first_page + i * PAGE_SIZE))
+            return NULL;
+    }
+
+    return (void *) vaddr;
+}
+
 // Checks if a given frame is reserved for user programs.
 bool user_frame_valid(u32 paddr) {
     for (u32 i = 0; i < user_physical_map_len; ++i) {
@@ -598,6 +758,169 @@ bool user_frame_valid(u32 paddr) {
     return false;
 }
 
+// Gives the current address space its own writable copy of the copy-on-write
+// page containing `vaddr`. The last address space holding on to a shared frame
+// takes it over without copying. Returns false if the page isn't
+// copy-on-write.
+bool resolve_cow(void *vaddr) {
+    vaddr = (void *) ((u32) vaddr & ~0xFFF);
+    EntryInfo info = get_entry_info(vaddr);
+
+    if (!entry_present(info.entry) || !(info.entry & PTE_COPY_ON_WRITE))
+        return false;
+
+    u32 paddr = get_paddr(info.entry);
+    u16 flags = (get_flags(info.entry) & ~PTE_COPY_ON_WRITE) | PTE_WRITABLE;
+
+    if (frame_refs[paddr / PAGE_SIZE]) {
+        u32 copy = alloc_frame();
+        pmemcpy(map_window(0, copy), vaddr, PAGE_SIZE);
+        frame_release(paddr);
+        paddr = copy;
+    }
+
+    info.entry = create_entry(paddr, flags);
+    flush_entry_info(info);
+    invalidate_page(vaddr);
+    tlb_shootdown(vaddr);
+    return true;
+}
+
+// Creates a copy of the user part of the current address space and returns the
+// frame of its page directory. Only page tables are copied. Writable pages turn
+// copy-on-write in both address spaces and all other pages are shared. Pages
+// the user can't access are left out since they hold kernel state of the
+// current process.
+u32 clone_page_dir() {
+    u32 page_dir = new_page_dir();
+
+    for (u32 pdi = 1; pdi < KERNEL_PDI_START; ++pdi) {
+        if (!entry_present(PDE(pdi)) || !(PDE(pdi) & PDE_USER_MODE))
+            continue;
+
+        u32 table_paddr = alloc_frame();
+        u32 *table = map_window(1, table_paddr);
+
+        for (u32 pti = 0; pti < 1024; ++pti) {
+            u32 entry = PTE(pdi, pti);
+            table[pti] = 0;
+
+            if (!entry_present(entry) || !(entry & PTE_USER_MODE))
+                continue;
+
+            // Frames from the user's physical map are managed by the user,
+            // so they are shared as they are.
+            u32 paddr = get_paddr(entry);
+            if (!user_frame_valid(paddr)) {
+                frame_ref(paddr);
+                if (entry & PTE_WRITABLE) {
+                    entry = (entry & ~PTE_WRITABLE) | PTE_COPY_ON_WRITE;
+                    PTE(pdi, pti) = entry;
+                }
+            }
+
+            table[pti] = entry;
+        }
+
+        u32 *dir = map_window(0, page_dir);
+        dir[pdi] = set_paddr(PDE(pdi), table_paddr);
+    }
+
+    // Other threads of this process may still have writable entries cached.
+    // Remote flushes always flush the whole TLB so one shootdown covers every
+    // page we write protected.
+    flush_tlb();
+    tlb_shootdown(NULL);
+
+    return page_dir;
+}
+
+// Hands `pages` user pages at `src` in the current address space over to `dst`
+// in the address space with the page directory `page_dir`. Copy-on-write
+// grants work just like fork. Shared memory must not be copy-on-write already.
+// Read-only grants may also hand out kernel pages, which get mapped as user
+// pages. The pages must have been validated and nothing may be mapped at
+// `dst`.
+void grant_pages(
+    u32 page_dir, void *dst, void *src, u32 pages, GrantMode mode
+) {
+    u32 *entries = kernel_alloc(size_in_pages(pages * sizeof(*entries)));
+
+    for (u32 i = 0; i < pages; ++i) {
+        EntryInfo info = get_entry_info(src + i * PAGE_SIZE);
+        u32 paddr = get_paddr(info.entry);
+        entries[i] = info.entry;
+
+        if (mode == GRANT_MODE_MOVE) {
+            info.entry = 0;
+            flush_entry_info(info);
+            continue;
+        }
+
+        if (!user_frame_valid(paddr))
+            frame_ref(paddr);
+
+        if (mode == GRANT_MODE_READ_ONLY) {
+            u16 flags = PAGE_USER_MODE | PTE_READ_ONLY_GRANT;
+            entries[i] = create_entry(paddr, flags);
+        }
+        else if (mode == GRANT_MODE_COPY_ON_WRITE &&
+                 (info.entry & PTE_WRITABLE) && !user_frame_valid(paddr)) {
+            info.entry &= ~PTE_WRITABLE;
+            info.entry |= PTE_COPY_ON_WRITE;
+            entries[i] = info.entry;
+            flush_entry_info(info);
+        }
+    }
+
+    // One shootdown for every page we changed, like in clone_page_dir
+    if (mode == GRANT_MODE_MOVE || mode == GRANT_MODE_COPY_ON_WRITE) {
+        flush_tlb();
+        tlb_shootdown(NULL);
+    }
+
+    u32 old_page_dir = get_page_dir();
+    set_page_dir(page_dir);
+
+    for (u32 i = 0; i < pages; ++i) {
+        void *vaddr = dst + i * PAGE_SIZE;
+        u32 entry = entries[i];
+        KERNEL_ASSERT(!map_page(vaddr, get_paddr(entry), get_flags(entry)));
+    }
+
+    set_page_dir(old_page_dir);
+    kernel_free(entries);
+}
+
+bool granted_read_only(void *vaddr, u32 pages) {
+    for (u32 i = 0; i < pages; ++i) {
+        u32 entry = get_entry(vaddr + i * PAGE_SIZE);
+        if (!entry_present(entry) || !(entry & PTE_READ_ONLY_GRANT))
+            return false;
+    }
+
+    return true;
+}
+
+// Releases every page and page table in the user part of the current address
+// space. The caller must switch to another page directory right after since
+// the TLB isn't flushed.
+void free_user_pages() {
+    for (u32 pdi = 1; pdi < KERNEL_PDI_START; ++pdi) {
+        if (!entry_present(PDE(pdi)))
+            continue;
+
+        for (u32 pti = 0; pti < 1024; ++pti) {
+            u32 entry = PTE(pdi, pti);
+            if (entry_present(entry) && !user_frame_valid(get_paddr(entry)))
+                frame_release(get_paddr(entry));
+        }
+
+        free_frame(get_paddr(PDE(pdi)));
+        PDE(pdi) = 0;
+    }
+}
+
 #define GET_PHYS_MAP_INVALID_PTR 1
 
 // Returns a pointer to information about the physically available memory on the
@@ -783,12 +1106,13 @@ syscall_virt_transfer(void *vaddr_src, void *vaddr_dst, u32 aid_pair, u32 n) {
 
 // Performs all operations required to initialize our kernel memory management.
 void mem_init() {
-    current_page_dir = get_cr3();
+    this_cpu()->page_dir = get_cr3();
     kernel_page_dir = get_page_dir();
     init_free_list_page();
     init_frames();
     reinit_paging();
     init_heap();
+    init_frame_sharing();
 
     // FIXME: our use of the PAGE_WRITEABLE flag is very questionable. Here we
     // rely on the kernel having write access to this memory despite not setting
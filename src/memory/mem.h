@@ -12,11 +12,21 @@
 #define PAGE_WRITABLE  2   // Can user write?
 #define PAGE_GLOBAL    512 // Flush from TLB on CR3 reload?
 
+#define PAGE_WRITE_THROUGH 8
+#define PAGE_CACHE_DISABLE 16
+
+// Number of kernel pages that can be pointed at arbitrary frames with
+// map_window. Only usable with the kernel lock held.
+#define WINDOW_COUNT 2
+
 typedef struct {
     u32 addr;
     u32 len;
 } PhysicalMap;
 
+extern Heap user_ro_heap;
+extern u32 kernel_page_dir;
+
 extern void fpu_save(void *fpu_regs);
 extern void fpu_restore(void *fpu_regs);
 
@@ -39,9 +49,28 @@ void mem_init();
 u32 alloc_frame();
 RESULT map_page(void *vaddr, u32 paddr, u16 flags);
 void map_pages(void *vaddr, u32 paddr, u16 flags, u32 count);
+RESULT unmap_page(void *vaddr, u32 *entry);
 void swap_page_frames(void *vaddr1, void *vaddr2);
 
 u32 new_page_dir();
+u32 clone_page_dir();
+
+// How grant_pages hands pages over
+typedef enum {
+    GRANT_MODE_MOVE,          // Take the pages from the current address space
+    GRANT_MODE_COPY_ON_WRITE, // Both sides get their own copy once they write
+    GRANT_MODE_SHARED,        // Both sides see each other's writes
+    GRANT_MODE_READ_ONLY,     // The other side may only read the pages
+} GrantMode;
+
+void grant_pages(
+    u32 page_dir, void *dst, void *src, u32 pages, GrantMode mode
+);
+void free_user_pages();
+
+// Whether all `pages` pages at `vaddr` were mapped by a read-only grant
+bool granted_read_only(void *vaddr, u32 pages);
+bool resolve_cow(void *vaddr);
 
 void alloc_page(void *vaddr, u16 flags);
 void alloc_pages(void *vaddr, u16 flags, u32 count);
@@ -55,13 +84,21 @@ void *mem_alloc(Heap *heap, u32 pages, u16 flags);
 void *mem_realloc(Heap *heap, void *ptr, u32 pages);
 void mem_free(Heap *heap, void *ptr);
 
+void *map_physical(u32 paddr, u32 size, u16 flags);
+void unmap_physical(void *vaddr, u32 size);
+
 void *kernel_alloc(u32 pages);
 void *kernel_realloc(void *ptr, u32 pages);
 void kernel_free(void *ptr);
 
 void debug_heap(u32 pages);
 
+void *map_window(u32 index, u32 paddr);
+
 void *validate_user_readable(u32 vaddr);
+void *validate_user_readable_range(u32 vaddr, u32 size);
+bool in_user_space(u32 vaddr, u32 pages);
 void *validate_user_writable(u32 vaddr);
+void *validate_user_writable_range(u32 vaddr, u32 size);
 
 #endif // MEM_H_
@@ -2,25 +2,27 @@
 #include "lib/error.h"
 #include "memory/mem.h"
 
-void pool_init(ProcessPool *pool) {
+void pool_init(Pool *pool, u32 object_size) {
+    KERNEL_ASSERT(sizeof(void *) <= object_size && object_size <= PAGE_SIZE);
     pool->free_list = NULL;
+    pool->object_size = object_size;
 }
 
-Process *pool_create(ProcessPool *pool) {
+void *pool_create(Pool *pool) {
     if (!pool->free_list) {
-        Process *processes = kernel_alloc(1);
-        u32 n = PAGE_SIZE / sizeof(Process);
+        u8 *objects = kernel_alloc(1);
+        u32 n = PAGE_SIZE / pool->object_size;
 
         while (n--)
-            pool_destroy(pool, processes + n);
+            pool_destroy(pool, objects + n * pool->object_size);
     }
 
-    Process *proc = pool->free_list;
-    pool->free_list = *((Process **) proc);
-    return proc;
+    void *object = pool->free_list;
+    pool->free_list = *((void **) object);
+    return object;
 }
 
-void pool_destroy(ProcessPool *pool, Process *proc) {
-    *((Process **) proc) = pool->free_list;
-    pool->free_list = proc;
+void pool_destroy(Pool *pool, void *object) {
+    *((void **) object) = pool->free_list;
+    pool->free_list = object;
 }
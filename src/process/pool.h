@@ -2,20 +2,19 @@
 #define POOL_H_
 
 #include "lib/types.h"
-#include "memory/mem.h"
-#include "process/processes.h"
 
+// A free list allocator for fixed size kernel objects. Objects are carved out
+// of whole kernel pages so `object_size` can be at most a page.
 typedef struct {
-    Process *free_list;
-} ProcessPool;
-
-_Static_assert(sizeof(Process) <= PAGE_SIZE, "Process struct too big");
+    void *free_list;
+    u32 object_size;
+} Pool;
 
 // Right now the implementation will never decrease its capacity. Memory will
-// still be reused as processes are destroyed.
+// still be reused as objects are destroyed.
 
-void pool_init(ProcessPool *pool);
-Process *pool_create(ProcessPool *pool);
-void pool_destroy(ProcessPool *pool, Process *proc);
+void pool_init(Pool *pool, u32 object_size);
+void *pool_create(Pool *pool);
+void pool_destroy(Pool *pool, void *object);
 
 #endif // POOL_H_
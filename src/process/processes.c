@@ -1,8 +1,14 @@
 #include "processes.h"
+#include "drivers/apic/apic.h"
+#include "drivers/timer/clock.h"
 #include "drivers/timer/timer.h"
 #include "interrupts/interrupt.h"
+#include "ipc/endpoint.h"
 #include "ipc/mailbox.h"
+#include "ipc/notify.h"
+#include "kernel/init.h"
 #include "kernel/kernel.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
 #include "lib/libp.h"
 #include "lib/logging.h"
@@ -13,78 +19,497 @@
 #include "process/queue.h"
 #include "process/rb_tree.h"
 #include "sun/sun.h"
+#include "syscall/ring.h"
 #include "syscall/syscall.h"
 
-#define MAILBOX_RESERVED  17
+#define MAILBOX_RESERVED  MAILBOX_REGION_PAGES
 #define STACK_SIZE        (4 * PAGE_SIZE)
 #define STACK_TOP         ((void *) 0xbfc00000)
 #define PROCESS_ORG       ((void *) 0x420000)
 #define MAILBOX_DATA_ADDR (PROCESS_ORG - (PAGE_SIZE * MAILBOX_RESERVED))
-#define PCB_ADDR          (MAILBOX_DATA_ADDR - PAGE_SIZE)
+
+#define SPAWN_NAME_LENGTH 32
+
+#define KERNEL_STACK_PAGES 2
+#define KERNEL_STACK_SIZE  (KERNEL_STACK_PAGES * PAGE_SIZE)
 
 #define INIT_EFLAGS 0b1000000010
 
-ProcessPool process_pool;
-RbTree process_tree;
-Queue run_queue;
+// Bandwidth is a fraction of one cpu in fixed point with 20 fractional bits.
+#define RT_BANDWIDTH_SHIFT 20
+#define RT_BANDWIDTH_LIMIT ((95 << RT_BANDWIDTH_SHIFT) / 100)
 
-Process *current = NULL;
-CpuContext *current_ctx = NULL;
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
 
-u16 aid_counter = 1; // Start PIDs at the Most Sig 16 Bits
+#define RT_MIN_RUNTIME_US 100
+#define RT_MAX_PERIOD_US  1000000
+
+// Processes are looked up by aid in a two level table. Each leaf covers 1024
+// aids and fills exactly one page. Leaves are allocated on first use.
+#define AID_COUNT      0x10000
+#define AID_LEAF_BITS  10
+#define AID_LEAF_SIZE  (1 << AID_LEAF_BITS)
+#define AID_LEAF_COUNT (AID_COUNT / AID_LEAF_SIZE)
 
-ProcessControlBlock *pcb = PCB_ADDR;
-MailboxPage *mailbox_data = MAILBOX_DATA_ADDR;
+_Static_assert(AID_LEAF_SIZE * sizeof(Process *) == PAGE_SIZE, "Leaf size");
 
-__attribute__((noreturn)) extern void
-jump_usermode(void (*f)(), void *stack, ProcessControlBlock *pcb);
+Pool process_pool;
+Pool thread_pool;
+RbTree process_tree; // Live processes ordered by pid
 
-#define FIELD_PARENT_PTR(parent_type, field_name, field_ptr)                   \
-    ((parent_type *) ((u8 *) field_ptr - offsetof(parent_type, field_name)))
+static Process **process_table[AID_LEAF_COUNT];
+
+// Runnable real-time threads of all cpus ordered by deadline
+static Queue rt_run_queue;
+static u32 rt_bandwidth_used = 0;
+
+// Aids in use, including those of deleted processes that still have threads
+// running. Aid zero is never handed out.
+static u32 aid_bitmap[AID_COUNT / 32];
+
+u16 aid_counter = 1; // Start PIDs at the Most Sig 16 Bits
+
+MailboxPage *mailbox_data = MAILBOX_DATA_ADDR + PAGE_SIZE;
+
+__attribute__((noreturn)) extern void jump_usermode(Thread *thread);
+extern void switch_to(u32 *prev_esp, u32 next_esp);
 
 Process *get_process(u16 aid) {
-    RbNode *node = rb_find(&process_tree, aid << 16);
-    if (node)
-        return FIELD_PARENT_PTR(Process, rb_node, node);
+    Process **leaf = process_table[aid >> AID_LEAF_BITS];
+    if (leaf)
+        return leaf[aid & (AID_LEAF_SIZE - 1)];
     else
         return NULL;
 }
 
-static Process *run_queue_next() {
-    QueueNode *node = queue_poll(&run_queue);
+static void process_table_set(u16 aid, Process *proc) {
+    Process ***leaf = &process_table[aid >> AID_LEAF_BITS];
+
+    if (!*leaf) {
+        *leaf = kernel_alloc(1);
+        pmemset(*leaf, 0, PAGE_SIZE);
+    }
+
+    (*leaf)[aid & (AID_LEAF_SIZE - 1)] = proc;
+}
+
+static Thread *find_thread(Process *proc, u16 tid) {
+    for (Thread *t = proc->threads; t; t = t->next_sibling) {
+        if (get_pid_tid(t->pid) == tid)
+            return t;
+    }
+
+    return NULL;
+}
+
+// Looks up a thread by pid. A tid of zero refers to any thread of the process.
+Thread *get_thread(u32 pid) {
+    Process *proc = get_process(get_pid_aid(pid));
+    if (!proc)
+        return NULL;
+
+    if (get_pid_tid(pid) == 0)
+        return proc->threads;
+
+    return find_thread(proc, get_pid_tid(pid));
+}
+
+static Thread *rt_run_queue_peek() {
+    QueueNode *node = rt_run_queue.head;
+    return node ? FIELD_PARENT_PTR(Thread, queue_node, node) : NULL;
+}
+
+// Whether real-time thread `thread` should take the cpu away from `running`.
+static bool rt_preempts(Thread *thread, Thread *running) {
+    return !running->rt || thread->rt_deadline < running->rt_deadline;
+}
+
+// Picks the cpu a newly runnable real-time thread should preempt. Idle cpus go
+// first, then cpus running best-effort threads, then the cpu whose real-time
+// thread has the latest deadline.
+static Cpu *rt_target_cpu(Thread *thread) {
+    Cpu *target = NULL;
+
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *cpu = &cpus[i];
+        if (!cpu->online || !rt_preempts(thread, cpu->thread))
+            continue;
+        if (cpu->idle)
+            return cpu;
+        if (!target || !cpu->thread->rt ||
+            (target->thread->rt &&
+             cpu->thread->rt_deadline > target->thread->rt_deadline))
+            target = cpu;
+    }
+
+    return target;
+}
+
+// Queues a runnable real-time thread by deadline and preempts a cpu for it if
+// it should run right away. Throttled threads are queued once replenished.
+static void rt_run_queue_add(Thread *thread) {
+    if (thread->rt_throttled)
+        return;
+
+    QueueNode **link = &rt_run_queue.head;
+
+    while (*link) {
+        Thread *t = FIELD_PARENT_PTR(Thread, queue_node, *link);
+        if (thread->rt_deadline < t->rt_deadline)
+            break;
+        link = &(*link)->next;
+    }
+
+    thread->queue_node.next = *link;
+    *link = &thread->queue_node;
+    if (!thread->queue_node.next)
+        rt_run_queue.tail = &thread->queue_node;
+    rt_run_queue.count += 1;
+
+    Cpu *target = rt_target_cpu(thread);
+    if (target) {
+        target->need_resched = true;
+        smp_kick(target);
+    }
+}
+
+// Share of a cpu needed to run for `runtime` out of every `deadline`.
+static u32 rt_bandwidth(u64 runtime, u64 deadline) {
+    return (runtime << RT_BANDWIDTH_SHIFT) / deadline;
+}
+
+static bool thread_running(Thread *thread);
+
+// Starts the next period of a throttled thread with a full budget.
+static void rt_replenish(KernelTimer *timer) {
+    Thread *thread = FIELD_PARENT_PTR(Thread, rt_timer, timer);
+
+    thread->rt_deadline += thread->rt_period;
+    thread->rt_budget = thread->rt_runtime;
+    thread->rt_throttled = false;
+
+    // Blocked threads are queued when they wake up and running ones when they
+    // get switched out.
+    if (!thread->blocked && !thread_running(thread))
+        rt_run_queue_add(thread);
+}
+
+// Charges a real-time thread for the time it ran since it was last charged.
+// Once its budget runs out it is throttled until its next period starts, which
+// keeps it from eating into the bandwidth reserved by other threads.
+static void rt_charge(Thread *thread) {
+    u64 now = clock_ns();
+    u64 used = now - thread->rt_start;
+    thread->rt_start = now;
+
+    if (thread->rt_throttled)
+        return;
+
+    if (used < thread->rt_budget) {
+        thread->rt_budget -= used;
+        return;
+    }
+
+    u64 next_period = thread->rt_deadline - thread->rt_rel_deadline +
+                      thread->rt_period;
+    u64 delay = next_period > now ? next_period - now : 0;
+    u32 delay_ms = (delay + NS_PER_MS - 1) / NS_PER_MS;
+
+    thread->rt_budget = 0;
+    thread->rt_throttled = true;
+    timer_add(&thread->rt_timer, timer_deadline_ms(delay_ms), rt_replenish);
+}
+
+// Constant bandwidth server wake up rule. A real-time thread that slept keeps
+// its deadline only if running out its leftover budget before that deadline
+// stays within its bandwidth. Otherwise it starts a fresh reservation.
+static void rt_wake(Thread *thread) {
+    if (thread->rt_throttled)
+        return;
+
+    u64 now = clock_ns();
+    if (now >= thread->rt_deadline ||
+        thread->rt_budget * thread->rt_rel_deadline >
+            (thread->rt_deadline - now) * thread->rt_runtime) {
+        thread->rt_deadline = now + thread->rt_rel_deadline;
+        thread->rt_budget = thread->rt_runtime;
+    }
+}
+
+// Runs on every timer tick of every cpu. Real-time threads are charged as they
+// run, and a queued real-time thread with an earlier deadline than whatever
+// this cpu is running takes over right away instead of waiting for the end of
+// the time slice.
+void rt_tick() {
+    Cpu *cpu = this_cpu();
+    Thread *running = cpu->thread;
+
+    if (!running) // The cpu hasn't started scheduling yet
+        return;
+
+    if (running->rt) {
+        rt_charge(running);
+        if (running->rt_throttled)
+            cpu->need_resched = true;
+    }
+
+    Thread *next = rt_run_queue_peek();
+    if (next && !cpu->idle && rt_preempts(next, running))
+        cpu->need_resched = true;
+}
+
+// Queues a thread to run. Threads go to the first idle cpu with nothing queued
+// so new work spreads out right away, and to the calling cpu otherwise.
+static void run_queue_add(Thread *thread) {
+    if (thread->rt) {
+        rt_run_queue_add(thread);
+        return;
+    }
+
+    Cpu *target = this_cpu();
+
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *cpu = &cpus[i];
+        if (cpu->online && cpu->idle && !cpu->run_queue.count) {
+            target = cpu;
+            break;
+        }
+    }
+
+    thread->cpu = target;
+    queue_add(&target->run_queue, &thread->queue_node);
+
+    if (target->idle)
+        smp_kick(target);
+}
+
+static bool run_queue_remove(Thread *thread) {
+    if (thread->rt)
+        return queue_remove(&rt_run_queue, &thread->queue_node);
+
+    return thread->cpu &&
+           queue_remove(&thread->cpu->run_queue, &thread->queue_node);
+}
+
+static Cpu *busiest_cpu() {
+    Cpu *busiest = NULL;
+
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *cpu = &cpus[i];
+        if (!busiest || cpu->run_queue.count > busiest->run_queue.count)
+            busiest = cpu;
+    }
+
+    return busiest->run_queue.count ? busiest : NULL;
+}
+
+// Takes the real-time thread with the earliest deadline if there is one.
+// Otherwise takes the next thread off this cpu's run queue, stealing from the
+// busiest cpu when ours is empty.
+static Thread *run_queue_next() {
+    QueueNode *node = queue_poll(&rt_run_queue);
+
+    if (!node)
+        node = queue_poll(&this_cpu()->run_queue);
+
+    if (!node) {
+        Cpu *victim = busiest_cpu();
+        if (victim)
+            node = queue_poll(&victim->run_queue);
+    }
+
     if (node)
-        return FIELD_PARENT_PTR(Process, queue_node, node);
+        return FIELD_PARENT_PTR(Thread, queue_node, node);
     else
         return NULL;
 }
 
+// Peeks at the run queues without the kernel lock. Only good as a hint.
+static bool work_available() {
+    if (rt_run_queue.count)
+        return true;
+
+    for (u32 i = 0; i < cpu_count; ++i) {
+        if (cpus[i].run_queue.count)
+            return true;
+    }
+
+    return false;
+}
+
+static bool thread_running(Thread *thread) {
+    return thread->cpu && thread->cpu->thread == thread;
+}
+
+// Returns the first free aid at or after `start`, wrapping around, or zero if
+// every aid is taken.
+static u16 find_free_aid(u16 start) {
+    u32 words = AID_COUNT / 32;
+
+    // The first word is visited twice so the aids below `start` in it are
+    // checked last.
+    for (u32 i = 0; i <= words; ++i) {
+        u32 word = (start / 32 + i) % words;
+        u32 free = ~aid_bitmap[word];
+        if (i == 0)
+            free &= ~0u << (start % 32);
+
+        if (free)
+            return word * 32 + __builtin_ctz(free);
+    }
+
+    return 0;
+}
+
 static u32 next_free_aid() {
     /*
     The aid is a u16, this function returns the next aid,
     left shifted 16 bits in order to represent a u32 pid.
     */
-    u16 aid = aid_counter;
+    u16 aid = find_free_aid(aid_counter);
+    KERNEL_ASSERT(aid); // Too many processes
+
+    aid_counter = aid + 1;
+    return (u32) aid << 16;
+}
+
+// Returns the next unused tid of a process. Tid zero is never handed out since
+// it stands for the process as a whole.
+static u16 next_free_tid(Process *proc) {
+    u16 tid = proc->tid_counter;
 
     do {
-        u32 pid = (u32) aid << 16;
-        if (!rb_find(&process_tree, pid)) {
-            aid_counter = aid + 1;
-            return pid;
+        if (tid != 0 && !find_thread(proc, tid)) {
+            proc->tid_counter = tid + 1;
+            return tid;
         }
 
-        aid += 1;
-    } while (aid != aid_counter);
+        tid += 1;
+    } while (tid != proc->tid_counter);
+
+    KERNEL_ASSERT(false); // Too many threads
+}
+
+static Process *process_create(u32 pid, u32 page_dir) {
+    Process *p = pool_create(&process_pool);
+    pmemset(p, 0, sizeof(*p));
+    p->page_dir_paddr = page_dir;
+    p->tid_counter = 1;
+    queue_init(&p->mailbox_waiters);
+    queue_init(&p->sender_waiters);
+    queue_init(&p->notify_waiters);
+    queue_init(&p->event_waiters);
+    rb_insert(&process_tree, &p->rb_node, pid);
+
+    u16 aid = get_pid_aid(pid);
+    process_table_set(aid, p);
+    aid_bitmap[aid / 32] |= 1u << (aid % 32);
+    return p;
+}
+
+// Makes a process impossible to look up. Its aid stays reserved until the
+// process is freed.
+static void process_unlink(Process *proc) {
+    rb_remove(&process_tree, proc->rb_node.key);
+    process_table_set(get_pid_aid(proc->rb_node.key), NULL);
+}
+
+// Unlinks a process so it gets freed along with its last thread.
+static void process_kill(Process *proc) {
+    process_unlink(proc);
+    proc->dying = true;
+
+    // Blocked senders look the process up again and find it gone
+    wake_all(&proc->sender_waiters);
+}
+
+static void thread_start();
+
+// Creates a thread in `proc` that will start executing at `eip` with the stack
+// pointer set to `esp` and `arg` in eax. The thread is not scheduled.
+//
+// Every thread gets its own kernel stack. It is set up so that the first
+// switch_to into the thread returns into thread_start, which enters user mode
+// with the registers stored in the thread.
+static Thread *thread_create(Process *proc, u32 eip, u32 esp, u32 arg) {
+    Thread *t = pool_create(&thread_pool);
+    pmemset(t, 0, sizeof(*t));
+
+    t->kernel_stack = kernel_alloc(KERNEL_STACK_PAGES);
+    u32 *sp = t->kernel_stack + KERNEL_STACK_SIZE;
+    *--sp = 0;                // thread_start never returns
+    *--sp = (u32) thread_start;
+    *--sp = 0;                // ebp
+    *--sp = 0;                // ebx
+    *--sp = 0;                // esi
+    *--sp = 0;                // edi
+    t->kernel_esp = (u32) sp;
+
+    t->eip = eip;
+    t->esp = esp;
+    t->eflags = INIT_EFLAGS;
+    t->eax = arg;
+
+    t->process = proc;
+    t->pid = (u32) proc->rb_node.key | next_free_tid(proc);
+    t->next_sibling = proc->threads;
+    proc->threads = t;
+    proc->thread_count += 1;
 
-    KERNEL_ASSERT(false); // Too many processes
+    return t;
+}
+
+// Frees a process along with all memory in its address space. None of its
+// threads may be left.
+static void process_free(Process *proc) {
+    u16 aid = get_pid_aid(proc->rb_node.key);
+    aid_bitmap[aid / 32] &= ~(1u << (aid % 32));
+
+    u32 old_page_dir = get_page_dir();
+    set_page_dir(proc->page_dir_paddr);
+    mailbox_del(&proc->mailbox);
+    endpoints_free(proc);
+    free_user_pages();
+    set_page_dir(old_page_dir);
+
+    free_frame(proc->page_dir_paddr);
+    pool_destroy(&process_pool, proc);
+}
+
+// Unlinks a thread from its process and frees it. The thread must not be on
+// a run queue or running.
+static void thread_destroy(Thread *thread) {
+    Process *proc = thread->process;
+    Thread **link = &proc->threads;
+
+    timer_cancel(&thread->timeout);
+    if (thread->wait_queue)
+        queue_remove(thread->wait_queue, &thread->queue_node);
+
+    timer_cancel(&thread->rt_timer);
+    rt_bandwidth_used -= thread->rt_bandwidth;
+
+    while (*link != thread)
+        link = &(*link)->next_sibling;
+
+    *link = thread->next_sibling;
+    proc->thread_count -= 1;
+    kernel_free(thread->kernel_stack);
+    pool_destroy(&thread_pool, thread);
 }
 
 #define RO_FLAGS PAGE_USER_MODE
 #define RW_FLAGS (PAGE_WRITABLE | PAGE_USER_MODE)
 
-void exec_sun(const char *name, int arg) {
+// Loads the executable `name` from the sun into a new process and queues its
+// first thread with `arg` in eax. Returns the pid of the process, or zero if
+// there is no such executable.
+u32 exec_sun(const char *name, int arg) {
     TableEntry *entry = sun_exe_lookup(name);
 
-    KERNEL_ASSERT(entry && entry->text_size);
+    if (!entry || !entry->text_size)
+        return 0;
 
     void *text = PROCESS_ORG;
     void *rodata = align_next_page(text + entry->text_size - 1);
@@ -107,195 +532,1046 @@ void exec_sun(const char *name, int arg) {
     if (entry->bss_size)
         alloc_pages(bss, RW_FLAGS, (heap - bss) / PAGE_SIZE);
     alloc_pages(stack - STACK_SIZE, RW_FLAGS, STACK_SIZE / PAGE_SIZE);
-    alloc_pages(pcb, PAGE_WRITABLE, 1);
 
     sun_load_text(entry, text);
     sun_load_rodata(entry, rodata);
     sun_load_data(entry, data);
     pmemset(bss, 0, entry->bss_size);
 
-    pcb->prog_brk = heap;
-    pcb->eip = (u32) entry->entry_point;
-    pcb->esp = (u32) stack;
-    pcb->eflags = INIT_EFLAGS;
-    pcb->page_dir_paddr = page_dir;
-    pcb->eax = arg;
+    Process *p = process_create(next_free_aid(), page_dir);
+    p->prog_brk = heap;
 
-    pmemset(pcb->fpu_regs, 0, /*fpu_regs size*/ 512);
-
-    mailbox_init(&pcb->mailbox, mailbox_data, PAGE_WRITABLE);
-    heap_init(&pcb->heap, heap, heap_pages, PAGE_WRITABLE | PAGE_USER_MODE);
+    mailbox_init(&p->mailbox, mailbox_data, PAGE_WRITABLE);
+    heap_init(&p->heap, heap, heap_pages, PAGE_WRITABLE | PAGE_USER_MODE);
+    ring_init(&p->ring);
 
     set_page_dir(old_page_dir);
 
-    u32 pid = next_free_aid();
-    Process *p = pool_create(&process_pool);
-    p->page_dir_paddr = page_dir;
-    p->blocked = false;
-    rb_insert(&process_tree, &p->rb_node, pid);
-    queue_add(&run_queue, &p->queue_node);
+    Thread *t =
+        thread_create(p, (u32) entry->entry_point, (u32) stack, (u32) arg);
+    run_queue_add(t);
+
+    return p->rb_node.key;
+}
+
+// Frees the thread that switched away for the last time. This can only happen
+// once we are off its kernel stack.
+static void finish_switch() {
+    Cpu *cpu = this_cpu();
+    Thread *dead = cpu->dead_thread;
+
+    if (!dead)
+        return;
+
+    Process *proc = dead->process;
+    cpu->dead_thread = NULL;
+    thread_destroy(dead);
+
+    if (proc->dying && !proc->thread_count)
+        process_free(proc);
 }
 
+// Switches this cpu from the current thread to `next`. Threads of the same
+// process share a page directory so switching between them doesn't reload cr3.
+// Returns once the calling thread is switched back to, possibly on a different
+// cpu.
+static void switch_thread(Thread *next) {
+    Cpu *cpu = this_cpu();
+    Thread *prev = cpu->thread;
+
+    if (prev == next)
+        return;
+
+    if (prev->rt)
+        rt_charge(prev);
+    if (next->rt)
+        next->rt_start = clock_ns();
+
+    fpu_save(prev->fpu_regs);
+
+    cpu->thread = next;
+    cpu->idle = next == cpu->idle_thread;
+    cpu->need_resched = false;
+    next->cpu = cpu;
+
+    if (next->process)
+        set_page_dir(next->process->page_dir_paddr);
+    else
+        set_page_dir(kernel_page_dir);
+
+    cpu->tss.esp0 = (u32) next->kernel_stack + KERNEL_STACK_SIZE;
+    set_tls_base(next->tls_base);
+    fpu_restore(next->fpu_regs);
+
+    switch_to(&prev->kernel_esp, next->kernel_esp);
+    finish_switch();
+}
+
+// First code run by every new thread, reached through switch_to. This is the
+// only place other than the syscall and interrupt exits where we give up the
+// kernel lock on the way to user mode.
+__attribute__((noreturn)) static void thread_start() {
+    finish_switch();
+    kernel_unlock();
+    jump_usermode(current);
+}
+
+// Switches to the next thread on this cpu's run queue, or to the idle thread if
+// there is none. The current thread must already be queued, blocked or
+// exiting. Must be called with the kernel lock held.
 void schedule() {
-    current = run_queue_next();
-    KERNEL_ASSERT(current);
+    Thread *next = run_queue_next();
+    switch_thread(next ? next : this_cpu()->idle_thread);
+}
+
+// Puts the current thread back on a run queue. Real-time threads are charged
+// first so they aren't queued with a budget they no longer have.
+static void requeue_current() {
+    if (current->rt)
+        rt_charge(current);
+    run_queue_add(current);
+}
+
+// Puts the current thread back on a run queue and lets something else run.
+void yield() {
+    requeue_current();
+    schedule();
+}
+
+// Stops running the current thread until thread_wake is called on it.
+void thread_block() {
+    current->blocked = true;
+    schedule();
+}
+
+void thread_wake(Thread *thread) {
+    if (!thread->blocked)
+        return;
+
+    if (thread->wait_queue) {
+        queue_remove(thread->wait_queue, &thread->queue_node);
+        thread->wait_queue = NULL;
+    }
+
+    thread->blocked = false;
+    if (thread->rt)
+        rt_wake(thread);
+    run_queue_add(thread);
+}
+
+static void thread_timeout(KernelTimer *timer) {
+    Thread *thread = FIELD_PARENT_PTR(Thread, timeout, timer);
+
+    // Someone else may have woken the thread before it got to cancel us
+    if (!thread->blocked)
+        return;
 
-    set_page_dir(current->page_dir_paddr);
-    KERNEL_ASSERT(pcb->page_dir_paddr == current->page_dir_paddr);
-    fpu_restore(pcb->fpu_regs);
-    jump_usermode((void (*)()) pcb->eip, (void *) pcb->esp, pcb);
+    thread->timed_out = true;
+    thread_wake(thread);
 }
 
-// TODO: unify the below two functions. It's not really great that we have two
-// different cpu context info formats for syscalls vs other interrupts.
+// Blocks the current thread until thread_wake is called on it or the tick count
+// reaches `deadline`, where a deadline of zero never passes. If `queue` is
+// given, the thread waits on it so wake_all can find it. Returns false if the
+// deadline passed.
+bool thread_wait(Queue *queue, u64 deadline) {
+    Thread *thread = current;
 
-static void save_context_int(InterruptRegisters *regs) {
-    pmemcpy(pcb, (u32 *) regs + 1, 8 * sizeof(u32));
-    pcb->eflags = regs->eflags;
-    pcb->eip = regs->eip;
-    pcb->esp = regs->useresp;
-    fpu_save(pcb->fpu_regs);
+    thread->timed_out = false;
+    if (queue) {
+        thread->wait_queue = queue;
+        queue_add(queue, &thread->queue_node);
+    }
+    if (deadline)
+        timer_add(&thread->timeout, deadline, thread_timeout);
+
+    thread_block();
+
+    timer_cancel(&thread->timeout);
+    return !thread->timed_out;
+}
+
+// Wakes every thread waiting on `queue`.
+void wake_all(Queue *queue) {
+    QueueNode *node;
+
+    while ((node = queue_poll(queue))) {
+        Thread *thread = FIELD_PARENT_PTR(Thread, queue_node, node);
+        thread->wait_queue = NULL;
+        thread_wake(thread);
+    }
+}
+
+// Lets pending interrupts in and gives up the cpu if its time slice ran out.
+// Long running syscalls call this at points where the thread can safely be
+// switched out, so they don't hold up the rest of the system.
+void preempt_point() {
+    asm volatile("sti\n\tnop\n\tcli");
+
+    Cpu *cpu = this_cpu();
+    if (cpu->need_resched && current != cpu->idle_thread) {
+        cpu->need_resched = false;
+        yield();
+    }
+}
+
+// Destroys the thread running on this cpu and schedules something else. Frees
+// the process as well if it was deleted and this was its last thread.
+__attribute__((noreturn)) static void exit_current() {
+    this_cpu()->dead_thread = current;
+    schedule();
+    KERNEL_ASSERT(false); // Dead threads are never switched back to
+}
+
+// The idle thread of every cpu runs on the stack the cpu booted with. It waits
+// for work with interrupts enabled. Every interrupt brings it back here to
+// check the run queues, and cpus queueing work for us send an IPI. Must be
+// called with the kernel lock held.
+__attribute__((noreturn)) void cpu_idle() {
+    Cpu *cpu = this_cpu();
+    Thread *idle = pool_create(&thread_pool);
+
+    pmemset(idle, 0, sizeof(*idle));
+    idle->cpu = cpu;
+    cpu->idle_thread = idle;
+    cpu->thread = idle;
+    cpu->idle = true;
+
+    for (;;) {
+        Thread *next = run_queue_next();
+        if (next) {
+            switch_thread(next);
+            continue;
+        }
+
+        kernel_unlock();
+        do {
+            asm volatile("sti\n\thlt\n\tcli");
+        } while (!work_available());
+        kernel_lock();
+    }
 }
 
-static void save_context_syscall(CpuContext *ctx) {
-    pmemcpy(pcb, (u32 *) ctx, 8 * sizeof(u32));
-    pcb->eflags = ctx->eflags;
-    pcb->eip = ctx->eip;
-    pcb->esp = ctx->useresp;
-    fpu_save(pcb->fpu_regs);
+// Runs on every return to user mode with the kernel lock held. This is where
+// threads flagged by other cpus exit and where expired time slices are taken
+// away.
+void return_to_user() {
+    Cpu *cpu = this_cpu();
+
+    if (current->exiting)
+        exit_current();
+
+    if (cpu->need_resched) {
+        cpu->need_resched = false;
+        ring_poll(&current->process->ring);
+        yield();
+    }
 }
 
 void syscall_handler(CpuContext *ctx) {
+    kernel_lock();
+
+    if (current->exiting)
+        exit_current();
+
     current_ctx = ctx;
     if (!dispatch_syscall(ctx))
         printk(DEBUG, "Unknown syscall :(\n");
     current_ctx = NULL;
+
+    return_to_user();
+    kernel_unlock();
 }
 
 bool is_user_mode(u32 cs) {
     return (cs & 3) == 3;
 }
 
+// Called on scheduler ticks and reschedule IPIs. The switch itself happens in
+// return_to_user, after the interrupt has been acknowledged.
 void preempt(InterruptRegisters *regs) {
-    if (is_user_mode(regs->cs)) {
-        KERNEL_ASSERT(pcb->page_dir_paddr == current->page_dir_paddr);
-        save_context_int(regs);
-        queue_add(&run_queue, &current->queue_node);
-        pic_eoi(regs->int_no - 32);
-        schedule();
+    (void) regs;
+    this_cpu()->need_resched = true;
+}
+
+// Finds a thread of `dst` blocked reading a message from `sender_pid` to
+// `reader_pid` from `mailbox`. There can't be a matching message in the
+// mailbox since the thread would have taken it before blocking.
+static Thread *find_receiver(
+    Process *dst, MailboxHeader *mailbox, u32 sender_pid, u32 reader_pid
+) {
+    QueueNode *node = dst->mailbox_waiters.head;
+
+    for (; node; node = node->next) {
+        Thread *t = FIELD_PARENT_PTR(Thread, queue_node, node);
+        if (t->ipc_mailbox == mailbox &&
+            match_pid(sender_pid, t->ipc_sender_pid) &&
+            match_pid(reader_pid, t->ipc_reader_pid))
+            return t;
     }
-    else {
-        pic_eoi(regs->int_no - 32);
+
+    return NULL;
+}
+
+// Writes a message straight into the buffer of a blocked receiver of the
+// current process. Returns false if the buffer isn't writable anymore.
+static bool deliver_direct(
+    Thread *receiver, u32 sender_pid, u32 reader_pid, u8 flags, u8 size,
+    const char *data
+) {
+    MailboxMessage *message = receiver->ipc_message;
+    if (!validate_user_writable_range((u32) message, sizeof(*message)))
+        return false;
+
+    message->header.sender_pid = sender_pid;
+    message->header.reader_pid = reader_pid;
+    message->header.data_size = size;
+    message->header.flags = flags;
+    pmemcpy(message->data, data, size);
+
+    receiver->ipc_delivered = true;
+    return true;
+}
+
+// Wakes `thread` and runs it on this cpu right away, giving it the rest of the
+// current time slice. The current thread stays runnable. Best-effort threads
+// don't get to run on a real-time thread's reservation, so those are only
+// woken.
+static void thread_handoff(Thread *thread) {
+    thread_wake(thread);
+
+    if (current->rt && !thread->rt)
+        return;
+
+    if (run_queue_remove(thread)) {
+        requeue_current();
+        switch_thread(thread);
     }
 }
 
-u32 process_init(Process *p, u32 pid) {
-    if (pid == 0)
-        pid = next_free_aid();
-    u32 page_dir = new_page_dir();
-    p->page_dir_paddr = page_dir;
-    p->blocked = false;
+// Queues a message from the current thread to `reader_pid` in `mailbox`, one
+// of the mailboxes of `dst`. The mailbox is written through the kernel
+// windows, so the data is copied once and the address space only changes when
+// the mailbox has to grow. Threads of our own process blocked waiting for the
+// message get it copied straight into their buffer. Returns false if the
+// mailbox is full. Otherwise `receiver` is set to the thread waiting for the
+// message, if any.
+static bool queue_message(
+    Process *dst, MailboxHeader *mailbox, u32 reader_pid, u8 flags, u8 size,
+    const void *data, Thread **receiver
+) {
+    u32 sender_pid = GET_PID(current);
 
-    return pid;
+    *receiver = find_receiver(dst, mailbox, sender_pid, reader_pid);
+    if (*receiver && dst == current->process &&
+        deliver_direct(*receiver, sender_pid, reader_pid, flags, size, data))
+        return true;
+
+    if (mailbox_send_message(
+            mailbox, sender_pid, reader_pid, flags, size, data
+        ))
+        return true;
+
+    // Slow path, the mailbox has to grow inside the receiver's address space
+    set_page_dir(dst->page_dir_paddr);
+    bool grew = mailbox_grow(mailbox, size);
+    set_page_dir(current->process->page_dir_paddr);
+
+    return grew && mailbox_send_message(
+                       mailbox, sender_pid, reader_pid, flags, size, data
+                   );
 }
 
-SyscallResult syscall_send_message(
-    u32 reader_pid, u32 data_size, const char *data, u32 flags
+// Queues a message from the current thread and wakes whoever waits for it.
+// Returns false if the mailbox is full. Otherwise `receiver` is set to the
+// thread that was blocked reading exactly this message, if any, so the caller
+// can hand off to it.
+bool deliver_message(
+    Process *dst, MailboxHeader *mailbox, u32 reader_pid, u8 flags, u8 size,
+    const void *data, Thread **receiver
 ) {
-    u8 message_size = data_size & 0xFF;
-    char message_cpy[256];
-    pmemcpy(message_cpy, data, message_size);
-    message_cpy[message_size] = '\0';
-    i32 sender_pid = GET_PID(current);
-
-    // Switch address space
-    Process *dst = get_process(get_pid_aid(reader_pid));
-    KERNEL_ASSERT(dst); // Todo: Turn this into an error
+    if (!queue_message(dst, mailbox, reader_pid, flags, size, data, receiver))
+        return false;
+
+    // Also takes the receiver off the wait queue, so later sends in the same
+    // burst don't pick it again
+    if (*receiver)
+        thread_wake(*receiver);
+
+    // Threads in wait_events check whether the message is for them themselves
+    wake_all(&dst->event_waiters);
+
+    return true;
+}
+
+// Reserves room for granted pages on the heap of `dst`. Nothing is mapped
+// there until the grant is delivered.
+void *grant_region_alloc(Process *dst, u32 pages) {
     set_page_dir(dst->page_dir_paddr);
+    void *region = heap_try_alloc(&dst->heap, pages);
+    set_page_dir(current->process->page_dir_paddr);
+    return region;
+}
+
+void grant_region_free(Process *dst, void *region) {
+    set_page_dir(dst->page_dir_paddr);
+    heap_free(&dst->heap, region);
+    set_page_dir(current->process->page_dir_paddr);
+}
+
+static bool pages_overlap(u32 vaddr, u32 pages, void *start, u32 count) {
+    u32 begin = (u32) start;
+    return vaddr < begin + count * PAGE_SIZE &&
+           begin < vaddr + pages * PAGE_SIZE;
+}
+
+bool grant_range_valid(Process *proc, u32 vaddr, u32 pages) {
+    if (!in_user_space(vaddr, pages))
+        return false;
+
+    if (mailbox_region_overlaps(&proc->mailbox, vaddr, pages))
+        return false;
+    for (u32 i = 0; i < PROCESS_ENDPOINTS - 1; ++i) {
+        MailboxHeader *endpoint = proc->endpoints[i];
+        if (endpoint && mailbox_region_overlaps(endpoint, vaddr, pages))
+            return false;
+    }
+
+    SyscallRing *ring = &proc->ring;
+    if (ring->header && pages_overlap(vaddr, pages, ring->header, ring->pages))
+        return false;
+
+    for (Thread *t = proc->threads; t; t = t->next_sibling) {
+        u32 stack_pages = STACK_SIZE / PAGE_SIZE;
+        if (t->stack_alloc &&
+            pages_overlap(vaddr, pages, t->stack_alloc, stack_pages))
+            return false;
+    }
+
+    return true;
+}
+
+// Shared memory has to be writable and loses any copy-on-write sharing with
+// other processes first, otherwise writes wouldn't show on the other side.
+static bool grant_valid(Process *src, PageGrant *grant) {
+    u32 addr = (u32) grant->addr;
+    u32 size = grant->pages * PAGE_SIZE;
+
+    if (addr & 0xFFF || !grant->pages || grant->pages > GRANT_MAX_PAGES)
+        return false;
+    if (!grant_range_valid(src, addr, grant->pages))
+        return false;
+
+    if (grant->flags & GRANT_SHARE_MEMORY)
+        return !(grant->flags & GRANT_SHARE) &&
+               validate_user_writable_range(addr, size);
+
+    return validate_user_readable_range(addr, size);
+}
+
+static GrantMode grant_mode(PageGrant *grant) {
+    if (grant->flags & GRANT_SHARE_MEMORY)
+        return GRANT_MODE_SHARED;
+    if (grant->flags & GRANT_SHARE)
+        return GRANT_MODE_COPY_ON_WRITE;
+    return GRANT_MODE_MOVE;
+}
+
+#define SEND_MESSAGE_INVALID_PTR   1
+#define SEND_MESSAGE_NOT_FOUND     2
+#define SEND_MESSAGE_FULL          3
+#define SEND_MESSAGE_INVALID_GRANT 4
+#define SEND_MESSAGE_NO_SPACE      5
+
+// Credits the process with the aid `aid` holds in the mailbox of `dst`
+static SendCredit *find_credit(Process *dst, u16 aid) {
+    for (u32 i = 0; i < SEND_CREDIT_SLOTS; ++i) {
+        SendCredit *credit = &dst->credits[i];
+        if (credit->bytes && credit->aid == aid)
+            return credit;
+    }
+
+    return NULL;
+}
+
+// Returns the reserved room of `credit` to the mailbox and frees the slot
+static u32 credit_release(Process *dst, SendCredit *credit) {
+    u32 bytes = credit->bytes;
+    mailbox_unreserve(&dst->mailbox, bytes);
+    credit->bytes = 0;
+    wake_all(&dst->sender_waiters);
+    return bytes;
+}
+
+// A free slot for a new holder of credits in the mailbox of `dst`. Slots held
+// by processes that are gone are taken back first.
+static SendCredit *credit_slot(Process *dst) {
+    SendCredit *free = NULL;
+
+    for (u32 i = 0; i < SEND_CREDIT_SLOTS; ++i) {
+        SendCredit *credit = &dst->credits[i];
+        if (credit->bytes && !get_process(credit->aid))
+            credit_release(dst, credit);
+        if (!credit->bytes && !free)
+            free = credit;
+    }
+
+    return free;
+}
+
+static u32 try_send(
+    u32 reader_pid, u32 data_size, const char *data, u32 flags, Process **dst,
+    Thread **receiver
+) {
+    u8 message_size = data_size & 0xFF;
+    if (message_size &&
+        !validate_user_readable_range((u32) data, message_size))
+        return SEND_MESSAGE_INVALID_PTR;
+
+    u16 aid = get_pid_aid(reader_pid);
+    if (!*dst || get_pid_aid((*dst)->rb_node.key) != aid)
+        *dst = get_process(aid);
+    if (!*dst)
+        return SEND_MESSAGE_NOT_FOUND;
 
     if (flags & IPC_SIGNAL) {
-        send_signal(message_cpy[0]);
+        notify_signal(*dst, 1u << ((message_size ? (u8) data[0] : 0) % 32));
+        return 0;
+    }
+
+    MailboxHeader *mailbox = endpoint_mailbox(*dst, IPC_ENDPOINT_ID(flags));
+    if (!mailbox)
+        return SEND_MESSAGE_NOT_FOUND;
+
+    PageGrant grant;
+    void *grant_src = NULL;
+    u8 message_flags = flags & PRIORITY_MASK;
+
+    if (flags & IPC_GRANT) {
+        if (message_size != sizeof(grant))
+            return SEND_MESSAGE_INVALID_GRANT;
+
+        pmemcpy(&grant, data, sizeof(grant));
+        if (!grant_valid(current->process, &grant))
+            return SEND_MESSAGE_INVALID_GRANT;
+
+        grant_src = grant.addr;
+        grant.addr = grant_region_alloc(*dst, grant.pages);
+        if (!grant.addr)
+            return SEND_MESSAGE_NO_SPACE;
+
+        data = (const char *) &grant;
+        message_flags |= MESSAGE_GRANT;
+    }
+
+    // Room reserved for us is handed back to the mailbox right before the
+    // message takes it, so the send can't fail for lack of room
+    u32 size = MESSAGE_OVERHEAD + message_size;
+    SendCredit *credit = find_credit(*dst, get_pid_aid(GET_PID(current)));
+    if (mailbox == &(*dst)->mailbox && credit && credit->bytes >= size) {
+        credit->bytes -= size;
+        mailbox_unreserve(mailbox, size);
+    }
+
+    if (!deliver_message(
+            *dst, mailbox, reader_pid, message_flags, message_size, data,
+            receiver
+        )) {
+        if (grant_src)
+            grant_region_free(*dst, grant.addr);
+        return SEND_MESSAGE_FULL;
     }
-    else {
-        mailbox_send_message(
-            &pcb->mailbox, sender_pid, reader_pid, message_size, message_cpy
+
+    // The receiver can't run before we let go of the kernel lock, so nobody
+    // looks at the message before we're done mapping the pages
+    if (grant_src)
+        grant_pages(
+            (*dst)->page_dir_paddr, grant.addr, grant_src, grant.pages,
+            grant_mode(&grant)
         );
+
+    return 0;
+}
+
+// Sends one message from the current thread and wakes the thread waiting for
+// it, which is returned through `receiver` so the caller can hand off to it.
+// Returns zero or one of the SEND_MESSAGE errors. `dst` caches the process
+// of the previous send, so bursts to the same process only look it up once.
+// With IPC_WAIT_SPACE a full mailbox blocks the thread until a read makes
+// room. Everything is checked again after waiting, the sender's memory and
+// the receiving process may have changed in the meantime. Batched sends
+// never wait.
+static u32 send_one(
+    u32 reader_pid, u32 data_size, const char *data, u32 flags, Process **dst,
+    Thread **receiver
+) {
+    *receiver = NULL;
+    if (current->batched)
+        flags &= ~IPC_WAIT_SPACE;
+
+    for (;;) {
+        u32 error = try_send(reader_pid, data_size, data, flags, dst, receiver);
+        if (error != SEND_MESSAGE_FULL || !(flags & IPC_WAIT_SPACE))
+            return error;
+
+        thread_wait(&(*dst)->sender_waiters, 0);
+        *dst = NULL;
     }
+}
 
-    // Todo: We will handle blocking later & differently
-    // if (dst->blocked) {
-    //     dst->blocked = false;
-    //     pcb->eax = read_message(mailbox, (void *) pcb->ebx);
-    //     KERNEL_ASSERT(pcb->eax);
-    //     queue_add(&run_queue, &dst->queue_node);
-    // }
+// Sends a message to the process `reader_pid` belongs to. A thread of that
+// process blocked waiting for the message is woken and run right away.
+// IPC_PRIORITY puts the message in a higher lane, ahead of the messages of
+// lower priority, and IPC_ENDPOINT sends it to one of the process's endpoints
+// instead of its mailbox.
+//
+// With IPC_GRANT the data is a PageGrant. The pages it describes are moved, or
+// shared with GRANT_SHARE or GRANT_SHARE_MEMORY, to a region on the reader's
+// heap, and the reader gets the grant rewritten to that region with
+// MESSAGE_GRANT set. No page contents are copied.
+//
+// A full mailbox fails the send with SEND_MESSAGE_FULL, or with IPC_WAIT_SPACE
+// blocks the caller until the receiver reads a message. Senders holding
+// credits in the mailbox, see reserve_credits, never find it full while their
+// credits last.
+SyscallResult syscall_send_message(
+    u32 reader_pid, u32 data_size, const char *data, u32 flags
+) {
+    Process *dst = NULL;
+    Thread *receiver;
 
-    // Switch back address space
-    set_page_dir(current->page_dir_paddr);
-    SYSCALL_RETURN(0, 0);
+    u32 error = send_one(reader_pid, data_size, data, flags, &dst, &receiver);
+    if (error)
+        SYSCALL_RETURN(false, error);
+
+    if (receiver)
+        thread_handoff(receiver);
+
+    SYSCALL_RETURN(true, 0);
+}
+
+#define SEND_MESSAGE_VEC_INVALID_PTR 1
+#define SEND_MESSAGE_VEC_TOO_LARGE   2
+
+// Sends `count` messages described by `entries` in one go, in order. Each
+// entry gets the result of its send in `status`, as send_message would have
+// returned it in its error. Receivers are woken as their messages arrive and
+// the first one gets the rest of our time slice once all are sent. Entries
+// never block, IPC_WAIT_SPACE is ignored. Returns the number of messages sent.
+SyscallResult syscall_send_message_vec(MessageVec *entries, u32 count) {
+    if (count > MESSAGE_VEC_MAX)
+        SYSCALL_RETURN(0, SEND_MESSAGE_VEC_TOO_LARGE);
+    if (count && !validate_user_writable_range(
+                     (u32) entries, count * sizeof(*entries)
+                 ))
+        SYSCALL_RETURN(0, SEND_MESSAGE_VEC_INVALID_PTR);
+
+    Process *dst = NULL;
+    Thread *first_receiver = NULL;
+    u32 sent = 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        MessageVec *entry = &entries[i];
+        Thread *receiver;
+
+        entry->status = send_one(
+            entry->reader_pid, entry->data_size, entry->data,
+            entry->flags & ~IPC_WAIT_SPACE, &dst, &receiver
+        );
+
+        if (!entry->status)
+            sent += 1;
+        if (!first_receiver)
+            first_receiver = receiver;
+    }
+
+    if (first_receiver)
+        thread_handoff(first_receiver);
+
+    SYSCALL_RETURN(sent, 0);
+}
+
+#define RESERVE_CREDITS_NOT_FOUND 1
+#define RESERVE_CREDITS_NO_SLOT   2
+#define RESERVE_CREDITS_FULL      3
+
+// Sets `bytes` of room aside for the calling process in the mailbox of the
+// process `pid` belongs to, growing it as needed. A message takes
+// MESSAGE_OVERHEAD bytes plus its data. Our sends to that process use up the
+// credits first, and never find the mailbox full while they last. With
+// IPC_WAIT_SPACE, waits for the receiver to read messages instead of failing
+// when its mailbox can't grow enough. Returns the credits we now hold there.
+SyscallResult syscall_reserve_credits(u32 pid, u32 bytes, u32 flags) {
+    u32 max_bytes = MAILBOX_MAX_PAGES * MAILBOX_DATA_SIZE;
+    if (bytes > max_bytes)
+        SYSCALL_RETURN(0, RESERVE_CREDITS_FULL);
+
+    u16 aid = get_pid_aid(GET_PID(current));
+    if (current->batched)
+        flags &= ~IPC_WAIT_SPACE;
+
+    for (;;) {
+        Process *dst = get_process(get_pid_aid(pid));
+        if (!dst)
+            SYSCALL_RETURN(0, RESERVE_CREDITS_NOT_FOUND);
+
+        SendCredit *credit = find_credit(dst, aid);
+        if (!credit)
+            credit = credit_slot(dst);
+        if (!credit)
+            SYSCALL_RETURN(0, RESERVE_CREDITS_NO_SLOT);
+
+        set_page_dir(dst->page_dir_paddr);
+        bool reserved = mailbox_reserve(&dst->mailbox, bytes);
+        set_page_dir(current->process->page_dir_paddr);
+
+        if (reserved) {
+            credit->aid = aid;
+            credit->bytes += bytes;
+            SYSCALL_RETURN(credit->bytes, 0);
+        }
+
+        if (!(flags & IPC_WAIT_SPACE))
+            SYSCALL_RETURN(0, RESERVE_CREDITS_FULL);
+
+        thread_wait(&dst->sender_waiters, 0);
+    }
+}
+
+// Gives the credits the calling process holds in the mailbox of the process
+// `pid` belongs to back. Returns how many bytes were released.
+SyscallResult syscall_release_credits(u32 pid) {
+    Process *dst = get_process(get_pid_aid(pid));
+    if (!dst)
+        SYSCALL_RETURN(0, 0);
+
+    SendCredit *credit = find_credit(dst, get_pid_aid(GET_PID(current)));
+    SYSCALL_RETURN(credit ? credit_release(dst, credit) : 0, 0);
 }
 
 SyscallResult syscall_register_process() {
-    Process *p = pool_create(&process_pool);
-    u32 pid = process_init(p, 0);
-    rb_insert(&process_tree, &p->rb_node, pid);
-    SYSCALL_RETURN(pid, 0);
+    Process *p = process_create(next_free_aid(), new_page_dir());
+    SYSCALL_RETURN(p->rb_node.key, 0);
 }
 
 #define PID_NOT_FOUND 1
 
 SyscallResult syscall_delete_process(u32 pid) {
     Process *proc = get_process(get_pid_aid(pid));
-    if (proc) {
-        u32 p_addr = proc->page_dir_paddr;
-        free_frame(p_addr);
-        rb_remove(&process_tree, pid);
-        pool_destroy(&process_pool, proc);
+    if (!proc)
+        SYSCALL_RETURN(0, PID_NOT_FOUND);
+
+    process_kill(proc);
+
+    // Threads running on a cpu, including the caller, can't be torn down from
+    // here. They are flagged and destroy themselves the next time they enter
+    // the kernel, which we force on other cpus with an IPI. The last of them
+    // frees the process.
+    Thread *t = proc->threads;
+    while (t) {
+        Thread *next = t->next_sibling;
+
+        if (thread_running(t)) {
+            t->exiting = true;
+            smp_kick(t->cpu);
+        }
+        else {
+            run_queue_remove(t);
+            thread_destroy(t);
+        }
+
+        t = next;
     }
 
-    SYSCALL_RETURN(0, PID_NOT_FOUND);
+    if (!proc->thread_count)
+        process_free(proc);
+
+    if (current->exiting)
+        exit_current();
+
+    SYSCALL_RETURN(0, 0);
 }
 
+// Switches to the thread given by `pid`. The calling thread goes back on the
+// run queue and sees the syscall succeed when it is resumed.
 SyscallResult syscall_jump_process(u32 pid) {
+    Thread *thread = get_thread(pid);
+    if (!thread)
+        SYSCALL_RETURN(0, PID_NOT_FOUND);
 
-    Process *proc = get_process(get_pid_aid(pid));
-    if (proc) {
-        current = proc;
-        set_page_dir(proc->page_dir_paddr);
-        fpu_restore(pcb->fpu_regs);
-        jump_usermode((void (*)()) pcb->eip, (void *) pcb->esp, pcb);
+    if (thread != current && run_queue_remove(thread)) {
+        requeue_current();
+        switch_thread(thread);
     }
 
-    SYSCALL_RETURN(0, PID_NOT_FOUND);
+    SYSCALL_RETURN(0, 0);
 }
 
+#define READ_MESSAGE_INVALID_PTR 1
+#define READ_MESSAGE_TIMED_OUT   2
+#define READ_MESSAGE_NOT_FOUND   3
+
+// Reads the oldest message of the highest priority matching `sender_pid` and
+// `reader_pid` into `message`. Returns whether a message was read. With
+// IPC_BLOCKING, waits for a matching message to arrive, for at most `timeout`
+// milliseconds unless it is zero. IPC_ENDPOINT reads from one of the process's
+// endpoints instead of its mailbox.
 SyscallResult syscall_read_message(
-    u32 sender_pid, u32 reader_pid, MailboxMessage *message, u32 flags
+    u32 sender_pid, u32 reader_pid, MailboxMessage *message, u32 flags,
+    u32 timeout
 ) {
-    bool res =
-        mailbox_read_message(&pcb->mailbox, sender_pid, reader_pid, message);
+    if (!validate_user_writable_range((u32) message, sizeof(*message)))
+        SYSCALL_RETURN(0, READ_MESSAGE_INVALID_PTR);
+
+    Thread *thread = current;
+    Process *proc = thread->process;
+    u64 deadline = timeout ? timer_deadline_ms(timeout) : 0;
+
+    if (thread->batched)
+        flags &= ~IPC_BLOCKING;
+
+    for (;;) {
+        // The endpoint may have been destroyed while we slept
+        MailboxHeader *mailbox = endpoint_mailbox(proc, IPC_ENDPOINT_ID(flags));
+        if (!mailbox)
+            SYSCALL_RETURN(false, READ_MESSAGE_NOT_FOUND);
+
+        if (mailbox_read_message(mailbox, sender_pid, reader_pid, message)) {
+            wake_all(&proc->sender_waiters);
+            SYSCALL_RETURN(true, 0);
+        }
+
+        if (!(flags & IPC_BLOCKING))
+            SYSCALL_RETURN(false, 0);
+
+        thread->ipc_sender_pid = sender_pid;
+        thread->ipc_reader_pid = reader_pid;
+        thread->ipc_mailbox = mailbox;
+        thread->ipc_message = message;
+        thread->ipc_delivered = false;
+
+        bool woken = thread_wait(&proc->mailbox_waiters, deadline);
+        thread->ipc_message = NULL;
+
+        if (thread->ipc_delivered)
+            SYSCALL_RETURN(true, 0);
+        if (!woken)
+            SYSCALL_RETURN(false, READ_MESSAGE_TIMED_OUT);
+    }
+}
+
+#define MAILBOX_MAP_NO_MAILBOX 1
 
-    (void) flags;
+// Maps the mailbox of the calling process's endpoint `endpoint`, zero being
+// the process mailbox, read-only into its address space, so it can check for
+// messages without a syscall. Returns the address of its MailboxStatus, see
+// ipc/mailbox.h. Mapping it again returns the same address.
+SyscallResult syscall_mailbox_map(u32 endpoint) {
+    MailboxHeader *mailbox = endpoint_mailbox(current->process, endpoint);
+    if (!mailbox || !mailbox->first_page)
+        SYSCALL_RETURN(0, MAILBOX_MAP_NO_MAILBOX);
 
-    // Todo: we will handle blocking later & differently
-    // if (blocking && !res) {
-    //     KERNEL_ASSERT(!current->blocked); // Can't issue syscall while
-    //     blocked current->blocked = true; save_context_syscall(current_ctx);
-    //     schedule();
-    // }
-    SYSCALL_RETURN(res, 0);
+    SYSCALL_RETURN((u32) mailbox_map_user(mailbox), 0);
+}
+
+#define THREAD_CREATE_INVALID_ENTRY 1
+#define THREAD_CREATE_INVALID_STACK 2
+
+// Creates a new thread in the calling process which starts at `entry` with
+// `arg` in eax and its thread local storage segment based at `tls_base`. If
+// `stack` is zero, a stack is allocated on the process heap. Otherwise it is
+// used as the initial stack pointer. Returns the pid of the new thread.
+SyscallResult
+syscall_thread_create(u32 entry, u32 stack, u32 arg, u32 tls_base) {
+    if (!validate_user_readable(entry))
+        SYSCALL_RETURN(0, THREAD_CREATE_INVALID_ENTRY);
+    if (stack && !validate_user_writable(stack - sizeof(u32)))
+        SYSCALL_RETURN(0, THREAD_CREATE_INVALID_STACK);
+
+    void *stack_alloc = NULL;
+    if (!stack) {
+        stack_alloc = mem_alloc(
+            &current->process->heap, STACK_SIZE / PAGE_SIZE, RW_FLAGS
+        );
+        stack = (u32) stack_alloc + STACK_SIZE;
+    }
+
+    Thread *t = thread_create(current->process, entry, stack, arg);
+    t->tls_base = tls_base;
+    t->stack_alloc = stack_alloc;
+    run_queue_add(t);
+
+    SYSCALL_RETURN(t->pid, 0);
+}
+
+// Terminates the calling thread. The process stays around as long as it has
+// other threads, even blocked ones. Exiting its last thread exits the process
+// just like deleting it would.
+SyscallResult syscall_thread_exit() {
+    Process *proc = current->process;
+
+    if (current->stack_alloc)
+        mem_free(&proc->heap, current->stack_alloc);
+    if (proc->thread_count == 1 && !proc->dying)
+        process_kill(proc);
+
+    exit_current();
+}
+
+// Creates a copy of the calling process. The copy shares all of the caller's
+// memory until one of them writes to it, and starts out with an empty mailbox
+// and no syscall ring. Its only thread is a copy of the calling thread that
+// returns from this syscall with zero. The caller gets the pid of the new
+// process.
+SyscallResult syscall_fork() {
+    Process *parent = current->process;
+    Process *p = process_create(next_free_aid(), clone_page_dir());
+
+    p->prog_brk = parent->prog_brk;
+    p->heap = parent->heap;
+    ring_init(&p->ring);
+
+    u32 old_page_dir = get_page_dir();
+    set_page_dir(p->page_dir_paddr);
+    mailbox_unmap_inherited(&parent->mailbox);
+    endpoints_drop_inherited(parent, &p->heap);
+    mailbox_init(&p->mailbox, mailbox_data, PAGE_WRITABLE);
+    set_page_dir(old_page_dir);
+
+    CpuContext *ctx = current_ctx;
+    Thread *t = thread_create(p, ctx->eip, ctx->useresp, 0);
+    t->edi = ctx->edi;
+    t->esi = ctx->esi;
+    t->ebp = ctx->ebp;
+    t->edx = ctx->edx;
+    t->ecx = ctx->ecx;
+    t->ebx = 0;
+    t->eflags = ctx->eflags;
+    t->tls_base = current->tls_base;
+    t->stack_alloc = current->stack_alloc;
+    fpu_save(t->fpu_regs);
+    run_queue_add(t);
+
+    SYSCALL_RETURN(p->rb_node.key, 0);
+}
+
+// Copies a string of less than `size` characters out of user memory. Returns
+// false if the string is too long or not readable.
+static bool copy_user_string(char *dst, u32 src, u32 size) {
+    for (u32 i = 0; i < size; ++i) {
+        bool page_start = i == 0 || (src + i) % PAGE_SIZE == 0;
+        if (page_start && !validate_user_readable(src + i))
+            return false;
+
+        dst[i] = ((const char *) src)[i];
+        if (!dst[i])
+            return true;
+    }
+
+    return false;
+}
+
+#define SPAWN_INVALID_NAME 1
+#define SPAWN_NOT_FOUND    2
+
+// Starts the executable called `name` in a new process, passing it `arg`.
+// Returns the pid of the new process.
+SyscallResult syscall_spawn(u32 name, u32 arg) {
+    char name_cpy[SPAWN_NAME_LENGTH];
+    if (!copy_user_string(name_cpy, name, sizeof(name_cpy)))
+        SYSCALL_RETURN(0, SPAWN_INVALID_NAME);
+
+    u32 pid = exec_sun(name_cpy, arg);
+    if (!pid)
+        SYSCALL_RETURN(0, SPAWN_NOT_FOUND);
+
+    SYSCALL_RETURN(pid, 0);
+}
+
+#define SCHED_DEADLINE_INVALID    1
+#define SCHED_DEADLINE_OVERLOADED 2
+
+// Moves the calling thread to the real-time class. In every period of
+// `period_us` microseconds it is guaranteed `runtime_us` of cpu time within
+// `deadline_us` of the start of the period. A deadline of zero means the end of
+// the period. Real-time threads run earliest deadline first ahead of every
+// best-effort thread. One that overruns its runtime is throttled until its
+// next period. The request is rejected if all reservations together would need
+// more than RT_BANDWIDTH_LIMIT of a cpu. A runtime of zero moves the thread
+// back to the best-effort class.
+SyscallResult
+syscall_sched_deadline(u32 runtime_us, u32 period_us, u32 deadline_us) {
+    Thread *thread = current;
+
+    if (!deadline_us)
+        deadline_us = period_us;
+
+    if (runtime_us &&
+        (runtime_us < RT_MIN_RUNTIME_US || runtime_us > deadline_us ||
+         deadline_us > period_us || period_us > RT_MAX_PERIOD_US))
+        SYSCALL_RETURN(0, SCHED_DEADLINE_INVALID);
+
+    u32 bandwidth = runtime_us ? rt_bandwidth(runtime_us, deadline_us) : 0;
+    u32 others = rt_bandwidth_used - thread->rt_bandwidth;
+    if (others + bandwidth > RT_BANDWIDTH_LIMIT)
+        SYSCALL_RETURN(0, SCHED_DEADLINE_OVERLOADED);
+
+    rt_bandwidth_used = others + bandwidth;
+    thread->rt_bandwidth = bandwidth;
+    thread->rt = runtime_us != 0;
+    thread->rt_throttled = false;
+    timer_cancel(&thread->rt_timer);
+
+    if (thread->rt) {
+        u64 now = clock_ns();
+        thread->rt_runtime = runtime_us * NS_PER_US;
+        thread->rt_period = period_us * NS_PER_US;
+        thread->rt_rel_deadline = deadline_us * NS_PER_US;
+        thread->rt_deadline = now + thread->rt_rel_deadline;
+        thread->rt_budget = thread->rt_runtime;
+        thread->rt_start = now;
+    }
+
+    SYSCALL_RETURN(0, 0);
+}
+
+// Sets the base of the calling thread's thread local storage segment.
+SyscallResult syscall_thread_set_tls(u32 tls_base) {
+    current->tls_base = tls_base;
+    set_tls_base(tls_base);
+    SYSCALL_RETURN(0, 0);
 }
 
 void processes_init() {
     syscall_reg_tmr_cb(preempt, 20 /*ms*/);
-    pool_init(&process_pool);
+    pool_init(&process_pool, sizeof(Process));
+    pool_init(&thread_pool, sizeof(Thread));
     rb_init(&process_tree);
-    queue_init(&run_queue);
+    aid_bitmap[0] |= 1; // Aid zero means no process
+    queue_init(&rt_run_queue);
+
+    lapic_install_handler(IPI_RESCHEDULE_VECTOR, preempt);
 
     register_syscall(0, syscall_send_message);
     register_syscall(1, syscall_read_message);
+    register_syscall(27, syscall_send_message_vec);
+    register_syscall(36, syscall_mailbox_map);
+    register_syscall(37, syscall_reserve_credits);
+    register_syscall(38, syscall_release_credits);
 
     register_syscall(2, syscall_register_process);
     register_syscall(3, syscall_delete_process);
     register_syscall(4, syscall_jump_process);
+
+    register_syscall(13, syscall_thread_create);
+    register_syscall(14, syscall_thread_exit);
+    register_syscall(16, syscall_thread_set_tls);
+    register_syscall(17, syscall_fork);
+    register_syscall(18, syscall_spawn);
+    register_syscall(23, syscall_sched_deadline);
+
+    set_syscall_flags(3, SYSCALL_NO_BATCH);
+    set_syscall_flags(4, SYSCALL_NO_BATCH);
+    set_syscall_flags(14, SYSCALL_NO_BATCH);
+    set_syscall_flags(17, SYSCALL_NO_BATCH);
 }
@@ -1,56 +1,175 @@
 #ifndef PROCESS_H_
 #define PROCESS_H_
 
+#include "drivers/timer/wheel.h"
 #include "ipc/mailbox.h"
+#include "kernel/smp.h"
 #include "lib/types.h"
 #include "memory/heap.h"
 #include "memory/mem.h"
 #include "queue.h"
 #include "rb_tree.h"
+#include "syscall/ring.h"
 
-typedef struct {
-    u32 page_dir_paddr;
+typedef struct Process_ Process;
+typedef struct Thread_ Thread;
 
-    // Since these nodes are stored at a known offset in Process, we can always
-    // determine the process corresponding to a given node.
-    QueueNode queue_node;
-    RbNode rb_node;
+#define SEND_CREDIT_SLOTS 8
+#define PROCESS_ENDPOINTS 16 // Including the process mailbox
 
-    bool blocked;
-} Process;
+// Mailbox room set aside for the messages of another process
+typedef struct {
+    u16 aid;   // Of the sending process
+    u32 bytes; // Zero if the slot is free
+} SendCredit;
 
-// NOTE: we assume the offsets of members up to eflags in the assembly so things
+// A schedulable context. Every thread belongs to exactly one process and shares
+// its address space with the other threads of that process.
+//
+// NOTE: we assume the offsets of members up to eip in the assembly so things
 // will break if thats changed
-typedef struct {
+struct Thread_ {
     u32 edi, esi, ebp, esp, ebx, edx, ecx, eax;
     u32 eflags;
     u32 eip;
 
-    void *prog_brk;
+    u8 fpu_regs[512] __attribute__((aligned(16)));
+
+    Process *process;
+    Thread *next_sibling; // Next thread of the same process
+
+    // Since this node is stored at a known offset in Thread, we can always
+    // determine the thread corresponding to a given node.
+    QueueNode queue_node;
+
+    u32 pid;
+    u32 tls_base;      // Base of the thread local storage segment
+    void *stack_alloc; // Stack allocated by the kernel on the process heap
+
+    // Each thread traps into its own kernel stack, so a switched out thread
+    // keeps its user context there. `kernel_esp` is only valid while the
+    // thread is switched out.
+    void *kernel_stack;
+    u32 kernel_esp;
+
+    // User context of the syscall the thread is in, if any
+    struct CpuContext_ *syscall_ctx;
+
+    // The cpu whose run queue holds the thread or that last ran it
+    Cpu *cpu;
+
+    // While blocked in thread_wait, `queue_node` links the thread into
+    // `wait_queue` instead of a run queue.
+    Queue *wait_queue;
+    KernelTimer timeout;
+    bool timed_out;
+
+    // What a thread blocked in read_message is waiting for. A sender that
+    // finds it waiting hands the message over directly.
+    u32 ipc_sender_pid;
+    u32 ipc_reader_pid;
+    MailboxHeader *ipc_mailbox; // Of the endpoint being read
+    MailboxMessage *ipc_message;
+    bool ipc_delivered;
+
+    // Physical address of the word a thread blocked in futex_wait waits on
+    u32 futex_key;
+
+    // Real-time scheduling parameters and state, see syscall_sched_deadline.
+    // Times are in nanoseconds.
+    bool rt;
+    bool rt_throttled; // Out of budget until `rt_timer` replenishes it
+    u32 rt_bandwidth;  // Share of a cpu reserved by admission control
+    u64 rt_runtime;
+    u64 rt_period;
+    u64 rt_rel_deadline;
+    u64 rt_deadline; // Absolute deadline of the current reservation
+    u64 rt_budget;   // Runtime left before `rt_deadline`
+    u64 rt_start;    // Clock time the budget was last charged up to
+    KernelTimer rt_timer;
+
+    bool batched; // Running a syscall submitted through the syscall ring
+    bool blocked;
+    bool exiting; // Destroy the thread the next time it enters the kernel
+};
+
+// An address space and the state shared by all threads in it. The pid of a
+// process has a tid of zero.
+struct Process_ {
     u32 page_dir_paddr;
 
-    u8 fpu_regs[512] __attribute__((aligned(16)));
+    // Since this node is stored at a known offset in Process, we can always
+    // determine the process corresponding to a given node.
+    RbNode rb_node;
+
+    Thread *threads;
+    u16 thread_count;
+    u16 tid_counter;
+
+    bool dying; // Deleted, freed once its last running thread has exited
 
+    void *prog_brk;
+
+    // The mailbox data and heap pages live in the process's address space.
+    // Only their bookkeeping is kept here.
     MailboxHeader mailbox;
+    Queue mailbox_waiters; // Threads blocked reading the mailbox
+    Queue sender_waiters;  // Threads waiting for room in the mailbox
+    SendCredit credits[SEND_CREDIT_SLOTS]; // See reserve_credits
 
+    // Mailboxes of the endpoints with ids 1 and up, see ipc/endpoint.h
+    MailboxHeader *endpoints[PROCESS_ENDPOINTS - 1];
     Heap heap;
-} ProcessControlBlock;
 
-_Static_assert(sizeof(ProcessControlBlock) <= PAGE_SIZE, "PCB too large");
+    u32 notify_bits;      // Pending notifications, see ipc/notify.h
+    Queue notify_waiters; // Threads blocked in notify_wait
+    Queue event_waiters;  // Threads blocked in wait_events
 
-typedef struct {
+    SyscallRing ring;
+};
+
+_Static_assert(sizeof(Process) <= PAGE_SIZE, "Process struct too big");
+_Static_assert(sizeof(Thread) <= PAGE_SIZE, "Thread struct too big");
+
+typedef struct CpuContext_ {
     u32 edi, esi, ebp, esp, ebx, edx, ecx, eax;
     u32 eip, cs, eflags, useresp;
 } CpuContext;
 
-#define GET_PID(proc) (proc->rb_node.key)
+#define GET_PID(thread) (thread->pid)
 
-extern Process *current;
-extern CpuContext *current_ctx;
+// The thread running on this cpu and its saved context while in a syscall
+#define current     (this_cpu()->thread)
+#define current_ctx (current->syscall_ctx)
 
-void exec_sun(const char *name, int arg);
-__attribute__((noreturn)) void schedule();
+u32 exec_sun(const char *name, int arg);
 void processes_init();
+
+void schedule();
+void yield();
+void thread_block();
+void thread_wake(Thread *thread);
+bool thread_wait(Queue *queue, u64 deadline);
+void wake_all(Queue *queue);
+
+bool deliver_message(
+    Process *dst, MailboxHeader *mailbox, u32 reader_pid, u8 flags, u8 size,
+    const void *data, Thread **receiver
+);
+void *grant_region_alloc(Process *dst, u32 pages);
+
+// Whether `pages` pages at `vaddr` may be granted away by `proc`. Pages the
+// kernel keeps using, like its mailboxes, syscall ring and thread stacks, and
+// pages in the kernel part of the address space never may.
+bool grant_range_valid(Process *proc, u32 vaddr, u32 pages);
+void grant_region_free(Process *dst, void *region);
+void preempt_point();
+void rt_tick();
+void return_to_user();
+bool is_user_mode(u32 cs);
+__attribute__((noreturn)) void cpu_idle();
+
 Process *get_process(u16 aid);
+Thread *get_thread(u32 pid);
 
 #endif
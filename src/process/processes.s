@@ -2,7 +2,7 @@ format ELF
 
 section ".text" executable
 
-;; NOTE: This assumes the layout of the PCB so it will break if that layout is
+;; NOTE: This assumes the layout of Thread so it will break if that layout is
 ;; changed.
 public jump_usermode
 jump_usermode:
@@ -10,18 +10,17 @@ jump_usermode:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x33 ; thread local storage GDT entry with RPL = 3
     mov gs, ax
 
-    mov ecx, [esp+0x4]
-    mov eax, [esp+0x8]
-    mov edx, [esp+0xC]
+    mov edx, [esp+0x4]
     push 0x23
-    push eax
+    push DWORD [edx+0x0C]
     mov eax, [edx+0x20]
     or eax, (1 shl 9) ; ensure interrupts are enabled when we enter user-mode
     push eax
     push 0x1b
-    push ecx
+    push DWORD [edx+0x24]
 
     mov edi, [edx+0x00]
     mov esi, [edx+0x04]
@@ -44,4 +43,25 @@ public fpu_restore
 fpu_restore:
     mov eax, [esp+0x04]
     fxrstor [eax]
-    ret
\ No newline at end of file
+    ret
+
+;; Saves the callee saved registers on the current kernel stack, stores the
+;; stack pointer to `prev_esp` and resumes whatever was saved on the stack at
+;; `next_esp`. Returns when something switches back to the saved stack.
+public switch_to
+switch_to:
+    mov eax, [esp+0x4]
+    mov edx, [esp+0x8]
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
@@ -31,3 +31,27 @@ QueueNode *queue_poll(Queue *q) {
     q->count -= 1;
     return head;
 }
+
+bool queue_remove(Queue *q, QueueNode *node) {
+    QueueNode *prev = NULL;
+    QueueNode *n = q->head;
+
+    while (n && n != node) {
+        prev = n;
+        n = n->next;
+    }
+
+    if (!n)
+        return false;
+
+    if (prev)
+        prev->next = n->next;
+    else
+        q->head = n->next;
+
+    if (q->tail == n)
+        q->tail = prev;
+
+    q->count -= 1;
+    return true;
+}
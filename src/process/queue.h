@@ -18,4 +18,8 @@ void queue_init(Queue *q);
 void queue_add(Queue *q, QueueNode *node);
 QueueNode *queue_poll(Queue *q);
 
+// Removes `node` from anywhere in the queue. Linear in the length of the queue.
+// Returns whether the node was found.
+bool queue_remove(Queue *q, QueueNode *node);
+
 #endif // QUEUE_H_
@@ -0,0 +1,146 @@
+#include "ring.h"
+#include "lib/error.h"
+#include "lib/libp.h"
+#include "memory/heap.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "syscall/syscall.h"
+
+#define RING_SETUP_INVALID_SIZE 1
+#define RING_SETUP_EXISTS       2
+
+#define RING_ENTER_NO_RING  1
+#define RING_ENTER_UNMAPPED 2
+
+void ring_init(SyscallRing *ring) {
+    pmemset(ring, 0, sizeof(*ring));
+}
+
+// The process may unmap its own ring at any time so we have to check that it's
+// still there before touching it.
+static bool ring_mapped(SyscallRing *ring) {
+    for (u32 i = 0; i < ring->pages; ++i) {
+        if (!validate_user_writable((u32) ring->header + i * PAGE_SIZE))
+            return false;
+    }
+
+    return true;
+}
+
+// Runs up to `max` submissions and posts their completions. Stops early when
+// the submission queue is empty or the completion queue is full, leaving the
+// remaining submissions for later. Also stops once the ring is gone, which a
+// batched syscall or another thread running while we were preempted can do.
+// Only one thread drains a ring at a time, the others leave the submissions to
+// it. Returns the number of submissions consumed.
+static u32 ring_drain(SyscallRing *ring, u32 max) {
+    SyscallRingHeader *header = ring->header;
+    u32 mask = ring->entries - 1;
+    u32 consumed = 0;
+
+    if (ring->draining)
+        return 0;
+    ring->draining = true;
+
+    while (consumed < max) {
+        if (!ring_mapped(ring))
+            break;
+        if (ring->sq_head == header->sq_tail)
+            break;
+        if (ring->cq_tail - header->cq_head >= ring->entries)
+            break;
+
+        // Copy the submission out first so the process can't change it from
+        // underneath the syscall, and consume it before running it.
+        RingSubmission sqe = ring->sq[ring->sq_head & mask];
+        ring->sq_head += 1;
+        consumed += 1;
+
+        SyscallResult res;
+        if (!invoke_syscall(sqe.num, sqe.args, true, &res))
+            res = (SyscallResult) {0, RING_INVALID_SYSCALL};
+
+        // The completion is lost along with the ring
+        if (!ring_mapped(ring))
+            break;
+
+        RingCompletion *cqe = &ring->cq[ring->cq_tail & mask];
+        cqe->user_data = sqe.user_data;
+        cqe->ret = res.ret;
+        cqe->err = res.err;
+
+        ring->cq_tail += 1;
+        header->sq_head = ring->sq_head;
+        header->cq_tail = ring->cq_tail;
+
+        // A full ring can take a while. Don't hog the cpu.
+        preempt_point();
+    }
+
+    ring->draining = false;
+    return consumed;
+}
+
+void ring_poll(SyscallRing *ring) {
+    if (!ring->header || !(ring->flags & RING_POLL))
+        return;
+    if (ring_mapped(ring))
+        ring_drain(ring, ring->entries);
+}
+
+// Creates the syscall ring of the calling process with `entries` submission
+// and completion slots. `entries` must be a power of two. Returns the address
+// of the ring header.
+SyscallResult syscall_ring_setup(u32 entries, u32 flags) {
+    Process *proc = current->process;
+    SyscallRing *ring = &proc->ring;
+
+    if (ring->header)
+        SYSCALL_RETURN(0, RING_SETUP_EXISTS);
+    if (!entries || entries > RING_MAX_ENTRIES || (entries & (entries - 1)))
+        SYSCALL_RETURN(0, RING_SETUP_INVALID_SIZE);
+
+    u32 sq_offset = sizeof(SyscallRingHeader);
+    u32 cq_offset = sq_offset + entries * sizeof(RingSubmission);
+    u32 size = cq_offset + entries * sizeof(RingCompletion);
+
+    ring->pages = size_in_pages(size);
+    ring->header =
+        mem_alloc(&proc->heap, ring->pages, PAGE_WRITABLE | PAGE_USER_MODE);
+    pmemset(ring->header, 0, ring->pages * PAGE_SIZE);
+
+    ring->sq = (void *) ring->header + sq_offset;
+    ring->cq = (void *) ring->header + cq_offset;
+    ring->entries = entries;
+    ring->flags = flags & RING_POLL;
+    ring->sq_head = 0;
+    ring->cq_tail = 0;
+
+    ring->header->entries = entries;
+    ring->header->flags = ring->flags;
+    ring->header->sq_offset = sq_offset;
+    ring->header->cq_offset = cq_offset;
+
+    SYSCALL_RETURN((u32) ring->header, 0);
+}
+
+// Processes up to `to_submit` pending submissions of the calling process.
+// Returns the number of submissions consumed.
+SyscallResult syscall_ring_enter(u32 to_submit) {
+    SyscallRing *ring = &current->process->ring;
+
+    if (!ring->header)
+        SYSCALL_RETURN(0, RING_ENTER_NO_RING);
+    if (!ring_mapped(ring))
+        SYSCALL_RETURN(0, RING_ENTER_UNMAPPED);
+
+    SYSCALL_RETURN(ring_drain(ring, to_submit), 0);
+}
+
+void rings_init() {
+    register_syscall(11, syscall_ring_setup);
+    register_syscall(12, syscall_ring_enter);
+
+    set_syscall_flags(11, SYSCALL_NO_BATCH);
+    set_syscall_flags(12, SYSCALL_NO_BATCH);
+}
@@ -0,0 +1,75 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include "lib/types.h"
+
+// A syscall ring lets a process batch syscalls through shared memory. The
+// process fills in submissions and advances `sq_tail`, then either calls
+// ring_enter or, if the ring was created with RING_POLL, waits for the kernel
+// to pick them up on a timer tick. Each submission is run through the regular
+// syscall table and produces one completion carrying the same `user_data`.
+// Batched syscalls never block: the ones that only wait can't be submitted and
+// the others act as if IPC_BLOCKING and IPC_WAIT_SPACE were not set.
+//
+// The ring memory is laid out as a header followed by the submission queue and
+// then the completion queue, each with `entries` slots. Indices only ever
+// increase and are masked with `entries - 1` to find their slot.
+
+#define RING_MAX_ENTRIES 256
+
+// Ring setup flags
+#define RING_POLL (1 << 0) // Drain submissions on timer ticks as well
+
+// Completion error for submissions naming a syscall that does not exist or
+// can't be batched.
+#define RING_INVALID_SYSCALL 0xFFFFFFFF
+
+typedef struct {
+    volatile u32 sq_head; // Written by the kernel
+    volatile u32 sq_tail; // Written by the process
+    volatile u32 cq_head; // Written by the process
+    volatile u32 cq_tail; // Written by the kernel
+    u32 entries;
+    u32 flags;
+    u32 sq_offset; // Byte offset of the submission queue from the header
+    u32 cq_offset; // Byte offset of the completion queue from the header
+} SyscallRingHeader;
+
+typedef struct {
+    u32 num;
+    u32 args[5];
+    u32 user_data;
+    u32 reserved;
+} RingSubmission;
+
+typedef struct {
+    u32 user_data;
+    u32 ret;
+    u32 err;
+    u32 reserved;
+} RingCompletion;
+
+// Kernel side state of a ring. This lives in the Process so the process can't
+// tamper with it. The kernel keeps its own copies of the indices it owns and
+// only ever publishes them to the shared header.
+typedef struct {
+    SyscallRingHeader *header; // NULL if the process has no ring
+    RingSubmission *sq;
+    RingCompletion *cq;
+    u32 entries;
+    u32 pages;
+    u32 flags;
+    u32 sq_head;
+    u32 cq_tail;
+    bool draining; // A thread of the process is running submissions
+} SyscallRing;
+
+void ring_init(SyscallRing *ring);
+
+// Processes pending submissions if the ring asked to be polled. Must be called
+// from within the address space owning the ring.
+void ring_poll(SyscallRing *ring);
+
+void rings_init();
+
+#endif // RING_H_
@@ -1,10 +1,15 @@
 #include "syscall.h"
+#include "kernel/init.h"
+#include "kernel/smp.h"
 #include "lib/error.h"
+#include "lib/libp.h"
+#include "memory/mem.h"
 #include "process/processes.h"
 
 #define NUM_SYSCALLS 101
 
 void *syscall_table[NUM_SYSCALLS] = {NULL};
+u8 syscall_flags[NUM_SYSCALLS] = {0};
 
 typedef SyscallResult (*Syscall)(u32 a, u32 b, u32 c, u32 d, u32 e);
 
@@ -14,19 +19,44 @@ void register_syscall(u32 num, void *syscall) {
     syscall_table[num] = syscall;
 }
 
-// The PCB must be updated with the processes current registers. It will be the
-// input and output of this function. Returns true if the syscall exists.
-bool dispatch_syscall(CpuContext *ctx) {
-    if (ctx->eax >= NUM_SYSCALLS)
+void set_syscall_flags(u32 num, u8 flags) {
+    KERNEL_ASSERT(num < NUM_SYSCALLS);
+    KERNEL_ASSERT(syscall_table[num]);
+    syscall_flags[num] = flags;
+}
+
+// Calls syscall `num` with the given arguments. Returns false if the syscall
+// does not exist or may not be called from a batch when `batched` is set.
+// Batched syscalls see `current->batched` set and must not block.
+bool invoke_syscall(
+    u32 num, const u32 *args, bool batched, SyscallResult *res
+) {
+    if (num >= NUM_SYSCALLS)
         return false;
-    Syscall syscall = syscall_table[ctx->eax];
+    Syscall syscall = syscall_table[num];
     if (!syscall)
         return false;
+    if (batched && (syscall_flags[num] & SYSCALL_NO_BATCH))
+        return false;
 
     // This works regardless of the number of actual expected parameters since
     // the callee is responsible for cleaning up the stack.
-    SyscallResult res =
-        syscall(ctx->ebx, ctx->ecx, ctx->edx, ctx->esi, ctx->edi);
+    current->batched = batched;
+    *res = syscall(args[0], args[1], args[2], args[3], args[4]);
+    current->batched = false;
+    return true;
+}
+
+// `ctx` is the user context saved on the calling thread's kernel stack. It is
+// both the input and output of this function. Returns true if the syscall
+// exists.
+bool dispatch_syscall(CpuContext *ctx) {
+    u32 args[5] = {ctx->ebx, ctx->ecx, ctx->edx, ctx->esi, ctx->edi};
+    SyscallResult res;
+
+    if (!invoke_syscall(ctx->eax, args, false, &res))
+        return false;
+
     ctx->eax = res.ret;
     ctx->ebx = res.err;
     return true;
@@ -44,6 +74,81 @@ SyscallResult syscall_debug() {
     SYSCALL_RETURN(0, 0);
 }
 
+extern void sysenter_wrapper();
+
+extern u8 syscall_trampoline_start[];
+extern u8 sysenter_trampoline[];
+extern u8 sysenter_trampoline_return[];
+extern u8 int80_trampoline[];
+extern u8 syscall_trampoline_end[];
+
+// Where sysexit sends us back to in user mode. Read by sysenter_wrapper.
+u32 sysenter_return = 0;
+
+// The address user programs call to make a syscall. Points into the trampoline
+// page and uses sysenter when the cpu supports it and `int 0x80` otherwise.
+static void *syscall_entry = NULL;
+
+#define TRAMPOLINE_ADDR(page, label)                                           \
+    ((page) + ((label) - syscall_trampoline_start))
+
+static bool sysenter_supported() {
+    CpuidRegs regs;
+    get_cpuid(CPUID_FEATURES, &regs);
+
+    // Early Pentium Pro parts report SEP without actually supporting it.
+    u32 family = (regs.eax >> 8) & 0xF;
+    u32 model = (regs.eax >> 4) & 0xF;
+    u32 stepping = regs.eax & 0xF;
+    if (family == 6 && model < 3 && stepping < 3)
+        return false;
+
+    return (regs.edx & CPUID_EDX_SEP) != 0;
+}
+
+// Copies the syscall trampolines into a page every process can read and
+// programs the sysenter MSRs of the boot cpu if it has them.
+static void init_sysenter() {
+    u32 size = syscall_trampoline_end - syscall_trampoline_start;
+    u8 *page = mem_alloc(&user_ro_heap, 1, PAGE_USER_MODE);
+
+    KERNEL_ASSERT(size <= PAGE_SIZE);
+    pmemcpy(page, syscall_trampoline_start, size);
+
+    if (!sysenter_supported()) {
+        printk(DEBUG, "SYSENTER unsupported, using int 0x80\n");
+        syscall_entry = TRAMPOLINE_ADDR(page, int80_trampoline);
+        return;
+    }
+
+    sysenter_return = (u32) TRAMPOLINE_ADDR(page, sysenter_trampoline_return);
+    syscall_entry = TRAMPOLINE_ADDR(page, sysenter_trampoline);
+
+    init_sysenter_cpu();
+}
+
+// Programs the sysenter MSRs of the calling cpu. Each cpu enters the kernel on
+// the stack found in its own TSS.
+void init_sysenter_cpu() {
+    if (!sysenter_return)
+        return;
+
+    // SYSENTER_CS is the kernel code segment. The cpu derives the kernel stack
+    // segment and the user segments used by sysexit from it, which matches our
+    // GDT layout.
+    write_msr(MSR_SYSENTER_CS, 0x08, 0);
+    write_msr(MSR_SYSENTER_ESP, (u32) &this_cpu()->tss.esp0, 0);
+    write_msr(MSR_SYSENTER_EIP, (u32) sysenter_wrapper, 0);
+}
+
+// Returns the address user programs should call to make a syscall.
+SyscallResult syscall_get_syscall_entry() {
+    SYSCALL_RETURN((u32) syscall_entry, 0);
+}
+
 void syscalls_init() {
+    init_sysenter();
+
+    register_syscall(10, syscall_get_syscall_entry);
     register_syscall(15, syscall_debug);
 }
@@ -14,9 +14,17 @@ typedef struct {
         ret, err                                                               \
     }
 
+// Syscall flags
+#define SYSCALL_NO_BATCH (1 << 0) // Can't be submitted through a syscall ring
+
 void register_syscall(u32 num, void *syscall);
+void set_syscall_flags(u32 num, u8 flags);
+bool invoke_syscall(
+    u32 num, const u32 *args, bool batched, SyscallResult *res
+);
 bool dispatch_syscall(CpuContext *ctx);
 void *delete_syscall(u32 num);
 void syscalls_init();
+void init_sysenter_cpu();
 
 #endif // SYSCALL_H_
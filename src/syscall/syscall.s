@@ -0,0 +1,77 @@
+format ELF
+
+section ".text" executable
+
+extrn syscall_handler
+extrn sysenter_return
+
+;; Fast system call entry. SYSENTER_ESP points at the esp0 field of the TSS so
+;; the first thing we do is pick up the same kernel stack an `int 0x80` would
+;; have used. The user trampoline below leaves the user esp in ebp with the
+;; caller's ebp, edx and ecx saved on top of it, so it can restore them once
+;; sysexit clobbered ecx and edx. The arguments themselves are still in their
+;; registers. The user stack is never read here, it may point anywhere, so the
+;; frame holds the user esp in place of ebp. Otherwise it is exactly the frame
+;; syscall_wrapper builds and syscall_handler can't tell the two apart.
+public sysenter_wrapper
+sysenter_wrapper:
+    mov esp, [esp]
+
+    push 0x23                  ; user ss
+    push ebp                   ; user esp
+    pushfd
+    or DWORD [esp], (1 shl 9)  ; sysenter clears IF but user mode always has it
+    push 0x1b                  ; user cs
+    push DWORD [sysenter_return]
+
+    pushad
+
+    push esp
+    call syscall_handler
+
+    add esp, 4
+
+    ; Interrupts stay off until the kernel stack is no longer in use. The sti
+    ; right before sysexit only takes effect after it.
+    cli
+    popad
+
+    mov edx, [esp+0x0] ; eip
+    mov ecx, [esp+0xC] ; user esp
+    add esp, 0x8
+    and DWORD [esp], not (1 shl 9)
+    popfd
+    add esp, 0x8
+    sti
+    sysexit
+
+;; User mode system call trampolines. These are never executed from here. They
+;; are copied into a user readable page at boot so everything in between the
+;; start and end labels must be position independent. User programs call the
+;; entry point published by syscall 10 with the same register convention as
+;; `int 0x80`.
+public syscall_trampoline_start
+syscall_trampoline_start:
+
+public sysenter_trampoline
+sysenter_trampoline:
+    push ecx
+    push edx
+    push ebp
+    mov ebp, esp
+    sysenter
+
+public sysenter_trampoline_return
+sysenter_trampoline_return:
+    pop ebp
+    pop edx
+    pop ecx
+    ret
+
+public int80_trampoline
+int80_trampoline:
+    int 0x80
+    ret
+
+public syscall_trampoline_end
+syscall_trampoline_end:
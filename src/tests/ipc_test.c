@@ -0,0 +1,75 @@
+#include "ipc_test.h"
+#include "ipc/mailbox.h"
+#include "ipc/topic.h"
+#include "lib/error.h"
+#include "lib/libp.h"
+#include "lib/types.h"
+#include "memory/mem.h"
+#include "process/processes.h"
+#include "terminal/terminal.h"
+
+// A process that was never scheduled, with its kernel regions at made up
+// addresses. Only the bookkeeping grant_range_valid looks at is set.
+static Process *fake_process(MailboxHeader *endpoint) {
+    Process *proc = kernel_alloc(1);
+    pmemset(proc, 0, sizeof(*proc));
+
+    proc->mailbox.first_page = (void *) 0x400000;
+    endpoint->first_page = (void *) 0x800000;
+    proc->endpoints[0] = endpoint;
+    return proc;
+}
+
+// Granting pages the kernel keeps using would let the receiver hold on to
+// frames the kernel frees, or unmap them from under the kernel. send_message
+// fails those grants with SEND_MESSAGE_INVALID_GRANT.
+void test_grant_ranges() {
+    MailboxHeader endpoint;
+    Process *proc = fake_process(&endpoint);
+
+    // The syscall trampolines and the clock page live on the user_ro_heap
+    u32 kernel_page = (u32) user_ro_heap.heap_start;
+    KERNEL_ASSERT(!grant_range_valid(proc, kernel_page, 1));
+    KERNEL_ASSERT(!grant_range_valid(proc, kernel_page - PAGE_SIZE, 2));
+
+    // Status page, data pages and copy page of the mailbox
+    u32 mailbox_page = (u32) proc->mailbox.first_page;
+    KERNEL_ASSERT(!grant_range_valid(proc, mailbox_page - PAGE_SIZE, 1));
+    KERNEL_ASSERT(!grant_range_valid(proc, mailbox_page, 1));
+    KERNEL_ASSERT(!grant_range_valid(
+        proc, mailbox_page + MAILBOX_MAX_PAGES * PAGE_SIZE, 1
+    ));
+
+    u32 endpoint_page = (u32) endpoint.first_page;
+    KERNEL_ASSERT(!grant_range_valid(proc, endpoint_page - 2 * PAGE_SIZE, 4));
+
+    // Right next to the mailbox is fine
+    u32 after_mailbox =
+        mailbox_page + (MAILBOX_REGION_PAGES - 1) * PAGE_SIZE;
+    KERNEL_ASSERT(grant_range_valid(proc, after_mailbox, 4));
+    KERNEL_ASSERT(grant_range_valid(proc, mailbox_page - 3 * PAGE_SIZE, 2));
+
+    kernel_free(proc);
+    terminal_printf("Grant range tests passed\n");
+}
+
+// topic_release only takes back payload mappings. Anything else on the heap,
+// like thread stacks or endpoint regions, stays where it is.
+void test_topic_release() {
+    Heap *heap = &user_ro_heap;
+    void *other = mem_alloc(heap, 2, PAGE_USER_MODE);
+    void *payload = heap_alloc(heap, 2);
+
+    // Read-only grants are also how topic_publish maps a payload
+    grant_pages(get_page_dir(), payload, other, 2, GRANT_MODE_READ_ONLY);
+
+    KERNEL_ASSERT(!topic_payload_pages(heap, other));
+    KERNEL_ASSERT(!topic_payload_pages(heap, payload + PAGE_SIZE));
+    KERNEL_ASSERT(!topic_payload_pages(heap, payload + 1));
+    KERNEL_ASSERT(topic_payload_pages(heap, payload) == 2);
+
+    heap_free(heap, payload);
+    free_pages(payload, 2);
+    mem_free(heap, other);
+    terminal_printf("Topic release tests passed\n");
+}
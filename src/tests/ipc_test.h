@@ -0,0 +1,7 @@
+#ifndef IPC_TEST_H_
+#define IPC_TEST_H_
+
+void test_grant_ranges();
+void test_topic_release();
+
+#endif // IPC_TEST_H_
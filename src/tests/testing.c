@@ -10,6 +10,7 @@
 #include "process/queue.h"
 #include "process/rb_tree.h"
 #include "terminal/terminal.h"
+#include "tests/ipc_test.h"
 
 void kernel_test() {
     terminal_printf("\nTesting is enabled!\n");
@@ -80,4 +81,7 @@ void kernel_test() {
             break;
         }
     }
-}
\ No newline at end of file
+
+    test_grant_ranges();
+    test_topic_release();
+}